@@ -14,7 +14,176 @@
 #include <libgimp/gimp.h>   // For application logic functions
 #include <libgimp/gimpui.h> // For application UI functions
 #include <math.h>           // Required only for floor()
+#include <stdio.h>          // For the optional stats dump to a file
+#include <string.h>         // For memcpy() in the banded I/O layer
+#include <sys/resource.h>   // For getrusage() in the benchmark procedure
 
+#ifdef HAVE_OPENCL
+#include <CL/cl.h>          // Optional GPU engine, CPU fallback otherwise
+#endif
+
+/* Rows transferred per gimp_pixel_rgn_get_rect()/set_rect() call; one
+   rect crossing of the tile machinery instead of 64 row crossings */
+#define MEDIAN_IO_BLOCK_ROWS 64
+
+/* Idle window that collapses a burst of widget changes into a single
+   preview recompute; short enough to feel immediate, long enough to
+   swallow a held-down spinner arrow */
+#define MEDIAN_PREVIEW_DEBOUNCE_MS 150
+
+/* Progress updates are paced by wall time, not row count, so a huge
+   selection width cannot starve the bar between updates */
+#define MEDIAN_PROGRESS_INTERVAL_US (100 * 1000)
+
+/* Peak-allocation budget of one vertical strip, in megabytes; wider
+   selections are sharded into strips until each fits. Overridable at
+   run time through the MEDIAN_MEMORY_MB environment variable */
+#define MEDIAN_SHARD_CEILING_MB 256
+
+/* Vector abstraction of the sorting-network engine: with SSE2 one
+   min/max pair sorts 16 pixels at once, otherwise the same network
+   code compiles to a scalar pixel-at-a-time kernel */
+#ifdef __SSE2__
+#include <emmintrin.h>
+typedef __m128i MedianVec;
+#define MEDIAN_VEC_WIDTH 16
+#define medianVecLoad(p)     _mm_loadu_si128 ((const __m128i *) (p))
+#define medianVecStore(p, v) _mm_storeu_si128 ((__m128i *) (p), (v))
+#define medianVecMin(a, b)   _mm_min_epu8 ((a), (b))
+#define medianVecMax(a, b)   _mm_max_epu8 ((a), (b))
+#else
+typedef guchar MedianVec;
+#define MEDIAN_VEC_WIDTH 1
+#define medianVecLoad(p)     (*(p))
+#define medianVecStore(p, v) (*(p) = (v))
+#define medianVecMin(a, b)   MIN ((a), (b))
+#define medianVecMax(a, b)   MAX ((a), (b))
+#endif
+
+
+/* Available median engines. The qsort engine is the original
+   per-pixel sort; the histogram engine is Huang's sliding
+   256-bin histogram, O(r) per pixel instead of O(r^2 log r) */
+typedef enum
+{
+  MEDIAN_ALGORITHM_QSORT = 0,
+  MEDIAN_ALGORITHM_HISTOGRAM,
+  MEDIAN_ALGORITHM_CONSTANT_TIME, // Perreault-Hebert column histograms, O(1) in radius
+  MEDIAN_ALGORITHM_SORTING_NETWORK, // branchless min/max networks, r=1 and r=2 only
+  MEDIAN_ALGORITHM_AUTO,          // per-(radius, bpp) winner from host calibration
+  MEDIAN_ALGORITHM_OPENCL         // GPU offload (HAVE_OPENCL builds), CPU fallback
+} MedianAlgorithm;
+
+/* Host calibration for MEDIAN_ALGORITHM_AUTO: one measured winner per
+   radius bucket and channel count, filled lazily the first time a
+   (bucket, bpp) combination is needed and persisted across plug-in
+   invocations via gimp_set_data, the same way UserInputValues is */
+#define MEDIAN_CALIB_VERSION   1
+#define MEDIAN_CALIB_NUM_RADII 4
+
+typedef struct
+{
+  gint  version;        // MEDIAN_CALIB_VERSION, anything else recalibrates
+  gint  calibratedBpp;  // bitmask of channel counts already measured
+  gchar winner[MEDIAN_CALIB_NUM_RADII][4];  // MedianAlgorithm per bucket/bpp
+} MedianCalibration;
+
+/* One 256-bin histogram per image column and channel, kept up to date
+   across the row loop (Perreault & Hebert, "Median Filtering in
+   Constant Time"). Merging 2r+1 of them per output pixel makes the
+   cost independent of the radius. Memory is
+   width * channels * 256 * sizeof(gushort), ~3 MB for a 4k RGB scan.
+
+   A second, coarse level of 16 buckets (each covering 16 fine bins)
+   rides along so rank scans are two-level radix searches: at most 16
+   coarse steps plus 16 fine steps instead of up to 256 linear ones.
+   The same 256+256 layout is what a 16-bit sample path would use,
+   with the fine level indexed by the low byte */
+typedef struct
+{
+  gushort *bins;      // channels * width histograms, 256 bins each
+  gushort *coarse;    // matching 16-bucket level, bucket = bin >> 4
+  gint     width;
+  gint     channels;
+} MedianColumnHistograms;
+
+/* Everything one worker needs to filter a horizontal band of the
+   selection on its own: a private row window, output row and (for the
+   constant-time engine) private column histograms. Bands only share
+   the drawable, and all tile traffic goes through TileAccessMutex
+   because the libgimp wire protocol is not thread-safe */
+typedef struct
+{
+  GimpPixelRgn *rgn_in;
+  GimpPixelRgn *rgn_out;
+  gint          x1, y1;          // selection origin
+  gint          width;
+  gint          height;          // full selection height, for edge clamping
+  gint          channels;        // bytes per pixel of the drawable
+  gint          bandStart;       // first output row of this band, selection-relative
+  gint          bandEnd;         // one past the last output row
+  gint          outColStart;     // first column actually written, strip-relative
+  gint          outWidth;        // columns written; the rest is seam overlap
+  gint          windowRows;      // 2r+1
+  gint          paddedWidth;     // width + 2r
+  guchar      **inputRow;
+  guchar       *outputRow;       // where the current row is rendered; aliases outBlock on the direct path
+  guchar       *outputRowStore;  // backing buffer for outputRow when it cannot alias the block
+  gboolean      directWrite;     // engines render straight into the output block (non-preview, whole-row strips)
+  guchar      **planeRow;        // channels * windowRows padded planar rows
+  guchar       *windowScratch;   // (2r+1)^2 sort workspace, reused for every pixel
+  guchar       *ioBlock;         // rect-read cache of MEDIAN_IO_BLOCK_ROWS input rows
+  gint          ioBlockStart;    // first selection row resident in ioBlock, -1 = empty
+  gint          ioBlockRows;     // rows resident in ioBlock
+  guchar       *outBlock;        // output rows accumulated for one rect write
+  gint          outBlockStart;   // selection row the next flush starts at
+  gint          outBlockRows;    // rows accumulated so far
+  guchar       *prefetchBlock;   // next input block, read ahead asynchronously
+  gint          prefetchStart;   // first selection row of the block being prefetched
+  gint          prefetchRows;    // rows the prefetch will deliver
+  GThread      *prefetchThread;  // in-flight prefetch, NULL when idle
+  MedianColumnHistograms *colHists;  // NULL unless constant-time engine
+  gboolean      reportProgress;  // only the main thread talks to the progress bar
+  GimpPixelRgn *rgn_mask;        // selection mask region, NULL when fully selected
+  gint          maskX, maskY;    // selection origin in mask (image) coordinates
+  guchar       *maskRow;         // one row of mask coverage, width bytes
+  gint          spanStart;       // first selected column of the current row
+  gint          spanEnd;         // one past the last selected column
+  guchar       *cacheMedianRows; // preview cache fill targets, NULL when
+  guchar       *cacheCenterRows; // the run is not being cached
+  gint          cacheRow;        // selection-relative row being computed
+  guchar      **hRow;            // horizontally 1-D-filtered window rows
+                                 // (separable mode), interleaved layout
+  guchar      **outPlane;        // per-channel output planes, width bytes
+  guint         channelEnabled;  // per-channel enable bits for this run
+  guint         rowChannelMask;  // effective bits for the current row
+  gboolean      warmActive;      // preview warm start: part of the cache
+  gint          warmRowStart;    // is still valid from the previous
+  gint          warmRowEnd;      // viewport, and rows/columns inside
+  gint          warmColStart;    // this rect are skipped
+  gint          warmColEnd;
+  gint          alphaChannel;    // index of the alpha channel, -1 when none
+  gboolean      alphaConstant;   // every alpha byte seen so far is alphaValue
+  gboolean      alphaSeen;       // alphaValue has been initialised
+  guchar        alphaValue;
+  gint64        statFetchUs;     // per-band instrumentation, folded into
+  gint64        statFetchBytes;  // MedianStatsTotals when the band ends;
+  gint64        statComputeUs;   // all zero unless MEDIAN_STATS is set
+  gint64        statWriteUs;
+  gint64        statWriteBytes;
+} MedianBandContext;
+
+/* Per-run totals of the major stages, filled only when the
+   MEDIAN_STATS environment variable is set */
+typedef struct
+{
+  gint64 fetchUs;     // wall time pulling rows through the tile layer
+  gint64 fetchBytes;  // bytes delivered into window rows
+  gint64 computeUs;   // wall time inside handleInputRow()
+  gint64 writeUs;     // wall time pushing rect blocks to shadow tiles
+  gint64 writeBytes;
+  gint64 wallStart;   // monotonic time the run began
+} MedianStats;
 
 /* Structure required for handling GUI */
 typedef struct
@@ -25,6 +194,10 @@ typedef struct
   gint     greaterThan;
   gboolean button;
   gboolean button2;
+  gint     algorithm;    // which MedianAlgorithm does the sorting work
+  gint     numThreads;   // worker count for band processing, 0 = one per core
+  gboolean separable;    // approximate two-pass 1-D mode instead of 2-D window
+  gboolean channel[4];   // per-channel enable; disabled ones copy through
 } MedianInputValues;
 
 
@@ -40,29 +213,160 @@ static inline void run         (const gchar      *name,
 
 static inline void median      (GimpDrawable     *drawable,
                          GimpPreview      *preview);
+static inline void medianProcessStrip (GimpDrawable *drawable,
+                                GimpPreview  *preview,
+                                gint          stripX1,
+                                gint          y1,
+                                gint          stripWidth,
+                                gint          height,
+                                gint          outColStart,
+                                gint          outWidth,
+                                gint          channels,
+                                gint          numBands,
+                                GimpDrawable *maskDrawable,
+                                gint          maskOffX,
+                                gint          maskOffY);
+static inline gint medianShardCount (gint width,
+                              gint channels,
+                              gint numBands);
+
+static inline void initializeMemory  (MedianBandContext *band);
+static inline void handleInputRow    (MedianBandContext *band);
+static inline void handleInputRowQsort     (MedianBandContext *band);
+static inline void handleInputRowHistogram (MedianBandContext *band);
+static inline void handleInputRowSeparable (MedianBandContext *band);
+static inline void medianFilterRowHorizontal (MedianBandContext *band,
+                                       gint               windowRow);
+
+static inline void resolveFilteringVariant (void);
+
+static inline MedianAlgorithm resolveActiveAlgorithm (gint channels);
+static inline void medianCalibrate (gint channels);
+
+static inline MedianColumnHistograms *columnHistogramsNew  (gint width,
+                                                     gint channels);
+static inline void columnHistogramsFree      (MedianColumnHistograms *colHists);
+static inline void columnHistogramsReset     (MedianColumnHistograms *colHists);
+static inline void columnHistogramsAddRow    (MedianColumnHistograms *colHists,
+                                       const guchar           *row);
+static inline void columnHistogramsRemoveRow (MedianColumnHistograms *colHists,
+                                       const guchar           *row);
+static inline void handleInputRowConstTime      (MedianBandContext *band);
+
+static inline void handleInputRowSortingNetwork (MedianBandContext *band);
+
+static inline void deinterleavePlaneRow (MedianBandContext *band,
+                                  gint               windowRow);
+
+static inline gboolean updateSelectedSpan (MedianBandContext *band,
+                                    gint               row);
+
+static inline void medianTrackAlphaRow (MedianBandContext *band,
+                                 const guchar      *row);
+
+static inline gboolean medianCacheMatches (gint x1,
+                                    gint y1,
+                                    gint width,
+                                    gint height,
+                                    gint channels);
+static inline void medianCachePrepare (gint x1,
+                                gint y1,
+                                gint width,
+                                gint height,
+                                gint channels);
+static inline void medianCacheApplyVariant (GimpDrawable *drawable,
+                                     GimpPreview  *preview);
+static inline void medianCacheWarmStart (gint x1,
+                                  gint y1,
+                                  gint width,
+                                  gint height,
+                                  gint channels);
+
+static inline void medianPreviewQuickPass (GimpDrawable *drawable,
+                                    GimpPreview  *preview,
+                                    gint          x1,
+                                    gint          y1,
+                                    gint          width,
+                                    gint          height,
+                                    gint          channels);
+static inline void medianFilterCoarseBuffer (const guchar *src,
+                                      guchar       *dst,
+                                      gint          width,
+                                      gint          height,
+                                      gint          channels,
+                                      gint          radius);
 
-static inline void initializeMemory  (guchar         ***inputRow,
-                               guchar          **outputRow,
-                               gint              num_bytes);
-static inline void handleInputRow    (guchar           **inputRow,
-                               guchar           *outputRow,
-                               gint              width,
-                               gint              channels);
+static inline gpointer medianProcessBand (gpointer data);
+static inline void medianSeedWindow  (MedianBandContext *band);
+static inline void medianProcessChunk (MedianBandContext *band);
+
+#ifdef HAVE_OPENCL
+static inline gboolean medianOpenClAvailable (void);
+static inline gboolean medianProcessBandOpenCL (MedianBandContext *band);
+#endif
+
+static inline void fetchRowBanded   (MedianBandContext *band,
+                              gint               row,
+                              guchar            *buf);
+static inline gpointer medianPrefetchBlock (gpointer data);
+static inline void writeRowBanded   (MedianBandContext *band,
+                              const guchar      *buf);
+static inline void flushOutputBlock (MedianBandContext *band);
+
+static inline void fetchRowLocked (GimpPixelRgn *rgn,
+                            guchar       *buf,
+                            gint          x,
+                            gint          y,
+                            gint          width);
 
 static inline gint compareNumbers (const void *a, const void *b);
 
 static inline void heapSort (gint [], gint);
 
-static inline void shuffle_tile_rows     (GimpPixelRgn     *rgn_in,
-                         guchar          **inputRow,
-                         gint              x1,
-                         gint              y1,
-                         gint              width,
-                         gint              height,
+static inline void shuffle_tile_rows     (MedianBandContext *band,
                          gint              ypos);
 
 static inline gboolean medianDialog (GimpDrawable *drawable);
 
+static inline gboolean medianPreviewInvalidateNow (gpointer data);
+static inline void medianPreviewInvalidateDebounced (GtkWidget *widget);
+
+static inline void medianStatsBegin    (void);
+static inline void medianStatsFoldBand (MedianBandContext *band);
+static inline void medianStatsDump     (gint width,
+                                 gint height,
+                                 gint channels);
+
+static inline guint medianChannelMaskKey (void);
+
+static inline gchar *medianDiskCacheKey (GimpDrawable *drawable,
+                                  gint          x1,
+                                  gint          y1,
+                                  gint          width,
+                                  gint          height,
+                                  gint          channels);
+static inline gboolean medianDiskCacheLoad (GimpDrawable *drawable,
+                                     const gchar  *key,
+                                     gint          x1,
+                                     gint          y1,
+                                     gint          width,
+                                     gint          height,
+                                     gint          channels);
+static inline void medianDiskCacheStore (GimpDrawable *drawable,
+                                  const gchar  *key,
+                                  gint          x1,
+                                  gint          y1,
+                                  gint          width,
+                                  gint          height,
+                                  gint          channels);
+
+static inline void medianBench (gint size,
+                         gint maxRadius);
+static inline void medianVerify (gint size,
+                          gint maxRadius);
+
+static inline void medianProcessAllLayers (gint32 image);
+
 static inline void updatePixelSize  (GimpSizeEntry *sizeentry,
                               GimpPreview   *preview);
 
@@ -70,13 +374,115 @@ static inline void updatePixelSize  (GimpSizeEntry *sizeentry,
 static MedianInputValues UserInputValues =
 {
   2,     // radius = 2
-  1,     // enable preview 
+  1,     // enable preview
   0,     // default lessThan filtering variant value
   0,     // default greaterThan filtering variant value
   FALSE,
-  FALSE
+  FALSE,
+  MEDIAN_ALGORITHM_AUTO,  // calibrated per-host winner; qsort kept as fallback
+  0,     // numThreads = 0: one worker per core
+  FALSE, // exact 2-D window by default; separable mode is opt-in
+  { TRUE, TRUE, TRUE, TRUE }  // all channels filtered by default
 };
 
+/* Every engine writes the raw window median into outputRow; the active
+   variant post-filter then keeps the original centre pixel wherever
+   the variant condition does not ask for replacement. medianRow and
+   the centre row share the same interleaved layout, so one tight loop
+   over width * channels samples covers all channels */
+typedef void (*MedianVariantRowFilter) (guchar       *medianRow,
+                                        const guchar *centerRow,
+                                        gint          numSamples);
+
+/* The post-filter of the current run; NULL means plain median */
+static MedianVariantRowFilter ActiveVariantFilter = NULL;
+
+/* Serializes all gimp_pixel_rgn_* and progress traffic — the libgimp
+   wire protocol must only ever see one call at a time */
+static GMutex TileAccessMutex;
+
+/* Cross-band progress aggregation */
+static volatile gint RowsDone  = 0;
+static gint          TotalRows = 0;
+
+/* Chunk scheduler of the worker pool: workers atomically pull the
+   next row chunk index instead of owning a fixed band, so cheap and
+   expensive regions balance themselves. Reset per strip */
+static volatile gint MedianNextChunk = 0;
+static gint          MedianChunkRows = 0;
+
+/* Multi-layer batch mode shares one progress bar: per-layer progress
+   is scaled into the [index/count, (index+1)/count] slot */
+static gint ProgressLayerIndex = 0;
+static gint ProgressLayerCount = 1;
+
+/* Preview cache of the raw (pre-variant) medians and the matching
+   centre rows. The variant checkboxes and spinners only change the
+   cheap threshold pass, so as long as the preview region, radius and
+   engine stay the same, toggling them reapplies the post-filter over
+   these buffers instead of re-sorting every window */
+typedef struct
+{
+  gint            x1, y1, width, height, channels;
+  gint            radius;
+  MedianAlgorithm algorithm;
+  gboolean        separable;
+  guint           channelMask;
+  guchar         *medianRows;  // raw medians, height rows, interleaved
+  guchar         *centerRows;  // window-centre input rows, same layout
+  gboolean        valid;
+} MedianResultCache;
+
+static MedianResultCache MedianCache = { 0 };
+
+/* Warm start across preview pans: the part of the previous viewport's
+   cache still valid at the new position, in new-viewport coordinates.
+   The run only recomputes rows and columns outside this rect */
+static struct
+{
+  gboolean active;
+  gint     rowStart, rowEnd;
+  gint     colStart, colEnd;
+} MedianWarm = { 0 };
+
+/* Preview invalidation coalescing: widget signals arm a short timeout
+   instead of invalidating directly, so a burst of changes triggers one
+   recompute; a change landing while a pass is in flight cancels it */
+static guint    PreviewDebounceId  = 0;
+static gboolean PreviewRunInFlight = FALSE;
+
+/* Cooperative cancellation: every band checks this between rows and
+   bails out; an aborted run never merges its half-written shadow
+   tiles, so the drawable stays untouched. Today the only source that
+   raises it is a superseding preview invalidation — the 2.x PDB gives
+   plug-ins no channel for a user cancel — but the engine does not
+   care where the request comes from */
+static volatile gint MedianCancelRequested = 0;
+
+/* Wall-clock timestamp of the last progress bar update */
+static gint64 LastProgressTime = 0;
+
+/* Stage timing controlled by the MEDIAN_STATS environment variable:
+   "1" dumps through g_message at end of run, any other value names a
+   file the dump line is appended to. Unset, every probe in the hot
+   path is a single flag test */
+static gboolean     MedianStatsOn   = FALSE;
+static const gchar *MedianStatsPath = NULL;
+static GMutex       MedianStatsMutex;
+static MedianStats  MedianStatsTotals;
+
+/* Calibration table of the automatic engine selector; the radii are
+   bucket upper bounds, a request falls into the first bucket that
+   covers it. r <= 2 never consults the table — the dispatcher routes
+   it to the sorting networks regardless */
+static MedianCalibration Calibration = { 0 };
+
+static const gint CalibrationRadii[MEDIAN_CALIB_NUM_RADII] = { 4, 8, 16, 30 };
+
+/* Engine median() actually runs this pass: UserInputValues.algorithm
+   with MEDIAN_ALGORITHM_AUTO resolved against the calibration table */
+static MedianAlgorithm ActiveAlgorithm = MEDIAN_ALGORITHM_HISTOGRAM;
+
 /* Standard GIMP structure */
 GimpPlugInInfo PLUG_IN_INFO =
 {
@@ -113,8 +519,54 @@ query (void)
     },
     { // Gets info about pixels, layers, layer masks, selections
       GIMP_PDB_DRAWABLE,
-      "drawable",                    
-      "Input drawable"
+      "drawable",
+      "Input drawable (-1 in headless runs = every layer of the image)"
+    },
+    { // The full parameter set below makes headless runs first-class;
+      // everything after radius is optional for old 4-argument scripts
+      GIMP_PDB_INT32,
+      "radius",
+      "Median window radius (1-30)"
+    },
+    {
+      GIMP_PDB_INT32,
+      "less-than",
+      "Variant threshold a of the x < m - a family, 0 disables"
+    },
+    {
+      GIMP_PDB_INT32,
+      "greater-than",
+      "Variant threshold b of the x > m + b family, 0 disables"
+    },
+    {
+      GIMP_PDB_INT32,
+      "button",
+      "First variant checkbox state (0 or 1)"
+    },
+    {
+      GIMP_PDB_INT32,
+      "button2",
+      "Second variant checkbox state (0 or 1)"
+    },
+    {
+      GIMP_PDB_INT32,
+      "algorithm",
+      "Engine: 0=qsort, 1=histogram, 2=constant-time, 3=sorting-network, 4=auto (calibrated), 5=opencl"
+    },
+    {
+      GIMP_PDB_INT32,
+      "num-threads",
+      "Worker threads for band processing, 0 = one per core"
+    },
+    {
+      GIMP_PDB_INT32,
+      "separable",
+      "Approximate separable mode: horizontal then vertical 1-D median (0 or 1)"
+    },
+    {
+      GIMP_PDB_INT32,
+      "channel-mask",
+      "Bitmask of channels to filter, bit 0 = first channel; others copy through (default all)"
     }
   };
   // Register plug-in in PDB
@@ -133,6 +585,84 @@ query (void)
     pluginInputParams,                // input values (from GimpParamDef)
     NULL);                            // return values
 
+  /* Input parameters of the headless benchmark procedure */
+  static GimpParamDef benchInputParams[] =
+  {
+    {
+      GIMP_PDB_INT32,
+      "run-mode",
+      "Run mode"
+    },
+    {
+      GIMP_PDB_INT32,
+      "size",
+      "Edge length in pixels of the synthetic noise image"
+    },
+    {
+      GIMP_PDB_INT32,
+      "max-radius",
+      "Radii 1..max-radius are swept for every engine"
+    }
+  };
+  /* Benchmark procedure: replaces the stopwatch timings that used to
+     live only in source comments. Prints wall time, rows/sec and peak
+     RSS per (engine, radius) configuration via g_message */
+  gimp_install_procedure (
+    "plug-in-median-bench",
+    "Median filter benchmark",
+    "Generates a synthetic noise image and times every median engine "
+    "across a radius sweep",
+    "Adam S. Grzonkowski",
+    "Copyright Adam S. Grzonkowski",
+    "2015",
+    NULL,                             // headless only, no menu entry
+    NULL,                             // works on its own synthetic image
+    GIMP_PLUGIN,
+    G_N_ELEMENTS (benchInputParams),
+    0,
+    benchInputParams,
+    NULL);
+
+  /* Input parameters of the headless verification procedure */
+  static GimpParamDef verifyInputParams[] =
+  {
+    {
+      GIMP_PDB_INT32,
+      "run-mode",
+      "Run mode"
+    },
+    {
+      GIMP_PDB_INT32,
+      "size",
+      "Edge length in pixels of the synthetic fixture images"
+    },
+    {
+      GIMP_PDB_INT32,
+      "max-radius",
+      "Radii 1..max-radius are verified for every engine"
+    }
+  };
+  /* Regression suite: every engine against the qsort reference on
+     GRAY, RGB and RGBA impulse-noise fixtures, byte-identical for the
+     exact engines and reported max error for the separable mode. Also
+     pins the reference rank definition itself. One machine-readable
+     g_message line per configuration */
+  gimp_install_procedure (
+    "plug-in-median-verify",
+    "Median filter engine verification",
+    "Filters synthetic fixtures through every median engine and checks "
+    "the output against the qsort reference, with timings",
+    "Adam S. Grzonkowski",
+    "Copyright Adam S. Grzonkowski",
+    "2015",
+    NULL,                             // headless only, no menu entry
+    NULL,                             // works on its own synthetic images
+    GIMP_PLUGIN,
+    G_N_ELEMENTS (verifyInputParams),
+    0,
+    verifyInputParams,
+    NULL);
+
   // Register plug-in in GIMP's UI
   gimp_plugin_menu_register ("plug-in-median",
                              "<Image>/Filters/Enhance");  //menu path of plug-in
@@ -163,375 +693,3314 @@ run (const gchar      *name,
 
   run_mode = inputValues[0].data.d_int32;      // Get run_mode
 
-  drawable = gimp_drawable_get (inputValues[2].data.d_drawable); // Get drawable
+  // The benchmark procedure brings its own image and returns early
+  if (! strcmp (name, "plug-in-median-bench"))
+    {
+      if (numberOfInputParams != 3)
+        values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+      else
+        medianBench (inputValues[1].data.d_int32,
+                     inputValues[2].data.d_int32);
+      return;
+    }
+
+  // So does the verification suite
+  if (! strcmp (name, "plug-in-median-verify"))
+    {
+      if (numberOfInputParams != 3)
+        values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+      else
+        medianVerify (inputValues[1].data.d_int32,
+                      inputValues[2].data.d_int32);
+      return;
+    }
+
+  // The engine calibration survives invocations next to the GUI options
+  gimp_get_data ("plug-in-median-calib", &Calibration);
+
+  /* Batch mode: drawable -1 in a headless run means "every layer of
+     the image", all in this one plug-in invocation */
+  gboolean allLayers = (run_mode != GIMP_RUN_INTERACTIVE &&
+                        inputValues[2].data.d_drawable == -1);
+
+  if (allLayers)
+    drawable = NULL;
+  else
+    drawable = gimp_drawable_get (inputValues[2].data.d_drawable); // Get drawable
+
+  switch (run_mode)                                       // Handle GIMP's all run modes 
+    {
+    case GIMP_RUN_INTERACTIVE:
+      gimp_get_data ("plug-in-median", &UserInputValues); // Get last chosen options in plug-in's GUI
+      if (! medianDialog (drawable))		          // Display the dialog window
+        return;
+      break;
+
+    case GIMP_RUN_NONINTERACTIVE:
+      if (numberOfInputParams < 4)                            // If not enough input values
+        status = GIMP_PDB_CALLING_ERROR;                      // call error
+      if (status == GIMP_PDB_SUCCESS)                         // If you have all you need
+        {
+          UserInputValues.radius = inputValues[3].data.d_int32; // Get radius value
+
+          // Everything past radius is optional so old scripts keep working
+          if (numberOfInputParams > 4)
+            UserInputValues.lessThan    = inputValues[4].data.d_int32;
+          if (numberOfInputParams > 5)
+            UserInputValues.greaterThan = inputValues[5].data.d_int32;
+          if (numberOfInputParams > 6)
+            UserInputValues.button      = inputValues[6].data.d_int32 != 0;
+          if (numberOfInputParams > 7)
+            UserInputValues.button2     = inputValues[7].data.d_int32 != 0;
+          if (numberOfInputParams > 8)
+            UserInputValues.algorithm   = inputValues[8].data.d_int32;
+          if (numberOfInputParams > 9)
+            UserInputValues.numThreads  = inputValues[9].data.d_int32;
+          if (numberOfInputParams > 10)
+            UserInputValues.separable   = inputValues[10].data.d_int32 != 0;
+          if (numberOfInputParams > 11)
+            {
+              gint mask = inputValues[11].data.d_int32;
+              gint k;
+
+              for (k = 0; k < 4; k++)
+                UserInputValues.channel[k] = (mask >> k) & 1;
+            }
+        }
+      break;
+
+    case GIMP_RUN_WITH_LAST_VALS:
+      gimp_get_data ("plug-in-median", &UserInputValues);     // Run with last chosen options
+      break;
+
+    default:
+      break;
+    }
+
+  if (allLayers)
+    medianProcessAllLayers (inputValues[1].data.d_image);
+  else
+    median (drawable, NULL);  // Call to median function
+
+  // These two functions send data to the gimp's core & update display
+  gimp_displays_flush ();
+  if (drawable)
+    gimp_drawable_detach (drawable);
+
+  //  Remember options chosen in GUI
+  if (run_mode == GIMP_RUN_INTERACTIVE)
+    gimp_set_data ("plug-in-median", &UserInputValues, sizeof (MedianInputValues));
+
+  return;
+}
+
+
+// --------------------- //
+//    Median filtering   //
+// --------------------- //
+static inline void
+median (GimpDrawable *drawable,
+        GimpPreview  *preview)
+{
+  gint          s, channels;
+  gint          x1, y1, x2, y2;
+  GimpDrawable *maskDrawable = NULL;
+  gint          maskOffX = 0, maskOffY = 0;
+  gint          numBands;
+  gint          numStrips, stripWidth;
+  gint          width, height;
+  gchar        *diskKey = NULL;
+
+  // If there's no preview
+  if (! preview)
+    {
+      gimp_progress_init ("Filtr medianowy..."); // initialize progress bar at the bottom of the screen
+      g_atomic_int_set (&MedianCancelRequested, 0);
+    }
+  LastProgressTime = g_get_monotonic_time ();
+  medianStatsBegin ();
+ 
+  /* If preview is active, get upper left and lower right 
+     coordinates of the selected area of an image and
+     set preview size accordingly to width & height of selection */
+  if (preview)
+    {
+      gimp_preview_get_position (preview, &x1, &y1);   
+      gimp_preview_get_size (preview, &width, &height);
+      x2 = x1 + width;
+      y2 = y1 + height;
+    }
+  else
+    {
+      /* Find the bounding box of the current selection 
+         in relation to the specified drawable */
+      gimp_drawable_mask_bounds (drawable->drawable_id,
+                                 &x1, &y1,
+                                 &x2, &y2);
+      width = x2 - x1;
+      height = y2 - y1;
+    }
+  
+  // Get number of channels for the specified drawable (returns bytes per pixel)
+  channels = gimp_drawable_bpp (drawable->drawable_id);
+
+  // Pick the variant post-filter once for the whole run
+  resolveFilteringVariant ();
+
+  // ...and the engine, calibrating the host first if AUTO needs it
+  ActiveAlgorithm = resolveActiveAlgorithm (channels);
+
+  /* No usable device (or a build without OpenCL) falls back to the
+     histogram engine; the one-time probe happens here, before any
+     worker thread could race it */
+  if (ActiveAlgorithm == MEDIAN_ALGORITHM_OPENCL)
+    {
+#ifdef HAVE_OPENCL
+      if (! medianOpenClAvailable ())
+#endif
+        ActiveAlgorithm = MEDIAN_ALGORITHM_HISTOGRAM;
+    }
+
+  /* Preview invalidations triggered by the variant widgets alone hit
+     the median cache: reapply the threshold pass over the cached raw
+     medians and skip the windowed filtering entirely */
+  if (preview)
+    {
+      /* Re-entered from the event pump of a running pass: mark that
+         pass stale and (re)arm the debounce timer ourselves. Widget
+         handlers arm it before invalidating, but the preview's own
+         pan/scroll invalidation arrives with no timer pending, and
+         dropping it would cancel the pass with nothing scheduled to
+         redo it */
+      if (PreviewRunInFlight)
+        {
+          g_atomic_int_set (&MedianCancelRequested, 1);
+          if (PreviewDebounceId)
+            g_source_remove (PreviewDebounceId);
+          PreviewDebounceId = g_timeout_add (MEDIAN_PREVIEW_DEBOUNCE_MS,
+                                             medianPreviewInvalidateNow,
+                                             preview);
+          return;
+        }
+
+      if (medianCacheMatches (x1, y1, width, height, channels))
+        {
+          medianCacheApplyVariant (drawable, preview);
+          return;
+        }
+
+      /* A pan with unchanged parameters: shift the still-valid part of
+         the cache to its new position and only recompute the exposed
+         rows and columns */
+      medianCacheWarmStart (x1, y1, width, height, channels);
+      medianCachePrepare (x1, y1, width, height, channels);
+
+      PreviewRunInFlight = TRUE;
+      g_atomic_int_set (&MedianCancelRequested, 0);
+
+      /* Progressive preview: put a cheap downsampled approximation on
+         screen first, then let the exact pass below overdraw it. At
+         small radii the network engine refines faster than the coarse
+         pass would help. A warm start skips it — most of the exact
+         result is already in the cache */
+      if (UserInputValues.radius >= 3 && ! MedianWarm.active)
+        medianPreviewQuickPass (drawable, preview,
+                                x1, y1, width, height, channels);
+    }
+
+  /* Allocate a big enough tile cache.
+     Multiply *2 because of also processing shadow tiles
+     Increases performance significantly */ 
+  gimp_tile_cache_ntiles (2 * (drawable->width / gimp_tile_width() + 1));
+
+  /* Split the selection into horizontal bands, one worker per band.
+     Rows only depend on their 2r+1 input rows, so bands are fully
+     independent. The preview path stays single-banded */
+  if (preview)
+    numBands = 1;
+  else
+    {
+      numBands = UserInputValues.numThreads > 0
+                   ? UserInputValues.numThreads
+                   : (gint) g_get_num_processors ();
+      numBands = CLAMP (numBands, 1, height);
+    }
+
+  /* A non-rectangular selection leaves unselected pixels inside the
+     bounding box; read the selection mask itself so the engines can
+     skip those spans instead of computing medians that merge_shadow
+     throws away. The preview already shows exactly the selection, so
+     it keeps the plain full-width path */
+  if (! preview)
+    {
+      gint32 image = gimp_drawable_get_image (drawable->drawable_id);
+
+      if (! gimp_selection_is_empty (image))
+        {
+          maskDrawable = gimp_drawable_get (gimp_image_get_selection (image));
+          gimp_drawable_offsets (drawable->drawable_id, &maskOffX, &maskOffY);
+        }
+    }
+
+  /* Opt-in on-disk memoization for repeated batch runs: hash the
+     input pixels plus the effective options and replay a stored
+     result instead of filtering. Non-trivial selections are excluded —
+     the mask shape is not part of the key */
+  if (! preview && ! maskDrawable)
+    {
+      diskKey = medianDiskCacheKey (drawable, x1, y1,
+                                    width, height, channels);
+      if (diskKey &&
+          medianDiskCacheLoad (drawable, diskKey,
+                               x1, y1, width, height, channels))
+        {
+          g_free (diskKey);
+          return;
+        }
+    }
+
+  RowsDone = 0;
+
+  /* Very wide selections are sharded into vertical strips processed
+     sequentially, so peak memory stays under the ceiling no matter how
+     wide the drawable is. Each strip re-reads r columns of its
+     neighbours, so windows near a seam see real pixels instead of the
+     clamped padding only true selection edges get. The preview
+     viewport is small and never shards */
+  numStrips  = preview ? 1 : medianShardCount (width, channels, numBands);
+  stripWidth = (width + numStrips - 1) / numStrips;
+  /* Re-derive the count from the rounded-up width: when the ceiling
+     division rounds up enough, the tail strips would start past the
+     region and degenerate to zero or negative widths */
+  numStrips  = (width + stripWidth - 1) / stripWidth;
+  TotalRows  = height * numStrips;
+
+  for (s = 0; s < numStrips; s++)
+    {
+      gint outX = x1 + s * stripWidth;
+      gint outW = MIN (stripWidth, x1 + width - outX);
+      gint inX1 = MAX (x1, outX - UserInputValues.radius);
+      gint inX2 = MIN (x1 + width, outX + outW + UserInputValues.radius);
+
+      medianProcessStrip (drawable, preview,
+                          inX1, y1, inX2 - inX1, height,
+                          outX - inX1, outW,
+                          channels, numBands,
+                          maskDrawable, maskOffX, maskOffY);
+
+      if (g_atomic_int_get (&MedianCancelRequested))
+        break;
+    }
+
+  // Update the modified region on preview
+  if (preview)
+    {
+      /* A cancelled pass draws nothing and leaves the cache invalid;
+         the debounce timer armed by the superseding change recomputes */
+      if (! g_atomic_int_get (&MedianCancelRequested))
+        {
+          /* Draw from the cache buffers rather than the shadow region:
+             a warm-started run never wrote the reused rows there */
+          MedianCache.valid = TRUE;  // the run filled both cache buffers
+          medianCacheApplyVariant (drawable, preview);
+        }
+      PreviewRunInFlight = FALSE;
+    }
+  else if (! g_atomic_int_get (&MedianCancelRequested))
+    {
+      gimp_drawable_flush (drawable);                           // send tile data to the core and get results
+      gimp_drawable_merge_shadow (drawable->drawable_id, TRUE); // merge shadow buffer with drawable
+      gimp_drawable_update (drawable->drawable_id,              // update the processed region of drawable
+                            x1, y1,
+                            width, height);
+
+      // A completed run is worth remembering for the next batch
+      if (diskKey)
+        medianDiskCacheStore (drawable, diskKey,
+                              x1, y1, width, height, channels);
+    }
+  /* Aborted run: the half-written shadow tiles are simply never
+     merged, which discards them and leaves the drawable untouched */
+
+  if (maskDrawable)
+    gimp_drawable_detach (maskDrawable);
+
+  g_free (diskKey);
+
+  /* Preview passes keep feeding the totals but only a committed run
+     emits a line — one per drawable, matching batch expectations */
+  if (! preview)
+    medianStatsDump (width, height, channels);
+}
+
+
+// -------------------------- //
+//  One vertical strip: band  //
+//  setup, the worker pool,   //
+//       and teardown         //
+// -------------------------- //
+/* The strip reads stripWidth columns starting at stripX1 but writes
+   only outWidth of them, outColStart columns in; the columns either
+   side are seam overlap, recomputed here so the windows that straddle
+   the seam see real neighbours, then thrown away because the adjacent
+   strip owns them */
+static inline void
+medianProcessStrip (GimpDrawable *drawable,
+                    GimpPreview  *preview,
+                    gint          stripX1,
+                    gint          y1,
+                    gint          stripWidth,
+                    gint          height,
+                    gint          outColStart,
+                    gint          outWidth,
+                    gint          channels,
+                    gint          numBands,
+                    GimpDrawable *maskDrawable,
+                    gint          maskOffX,
+                    gint          maskOffY)
+{
+  GimpPixelRgn *bandRgnIn, *bandRgnOut;
+  GimpPixelRgn *bandRgnMask = NULL;
+  MedianBandContext *bands;
+  GThread     **workers;
+  gint          b, ii;
+
+  /* Initialise two pixel ranges per band, one to read input data,
+     and the other to write output data. */
+  bandRgnIn  = g_new (GimpPixelRgn, numBands);
+  bandRgnOut = g_new (GimpPixelRgn, numBands);
+  bands      = g_new (MedianBandContext, numBands);
+  workers    = g_new (GThread *, numBands);
+  if (maskDrawable)
+    bandRgnMask = g_new (GimpPixelRgn, numBands);
+
+  /* Chunk scheduler: many more chunks than workers, each several
+     window heights tall so the per-chunk window re-seed stays a small
+     fraction of the work. A single worker takes the strip in one
+     chunk and seeds exactly once, like the old static split */
+  g_atomic_int_set (&MedianNextChunk, 0);
+  MedianChunkRows = numBands == 1
+                      ? height
+                      : MAX (MEDIAN_IO_BLOCK_ROWS,
+                             8 * (2 * UserInputValues.radius + 1));
+
+  for (b = 0; b < numBands; b++)
+    {
+      MedianBandContext *band = &bands[b];
+
+      gimp_pixel_rgn_init (&bandRgnIn[b],
+                           drawable,
+                           stripX1, y1,
+                           stripWidth, height,
+                           FALSE, FALSE); // 2*FALSE = the range is only used to read data
+      gimp_pixel_rgn_init (&bandRgnOut[b],
+                           drawable,
+                           stripX1, y1,
+                           stripWidth, height,
+                           preview == NULL, TRUE); // the range is used to write data
+
+      band->rgn_in    = &bandRgnIn[b];
+      band->rgn_out   = &bandRgnOut[b];
+      band->x1        = stripX1;
+      band->y1        = y1;
+      band->width     = stripWidth;
+      band->height    = height;
+      band->channels  = channels;
+      band->bandStart = 0;
+      band->bandEnd   = 0;
+      band->reportProgress = (b == 0 && ! preview);
+
+      /* Selection mask lives in image coordinates, so the drawable
+         offsets shift the region; each band reads mask rows through
+         its own region like the pixel I/O does */
+      if (maskDrawable)
+        {
+          gimp_pixel_rgn_init (&bandRgnMask[b],
+                               maskDrawable,
+                               stripX1 + maskOffX, y1 + maskOffY,
+                               stripWidth, height,
+                               FALSE, FALSE);
+          band->rgn_mask = &bandRgnMask[b];
+          band->maskX    = stripX1 + maskOffX;
+          band->maskY    = y1 + maskOffY;
+        }
+      else
+        band->rgn_mask = NULL;
+
+      // Preview runs fill the median cache as they compute
+      band->cacheMedianRows = preview ? MedianCache.medianRows : NULL;
+      band->cacheCenterRows = preview ? MedianCache.centerRows : NULL;
+      band->cacheRow        = 0;
+
+      // Allocate memory for tile inputRow, outputRow and channel planes
+      initializeMemory (band);
+
+      // Only the strip interior is written; the overlap is discarded
+      band->outColStart = outColStart;
+      band->outWidth    = outWidth;
+
+      /* Non-preview whole-row strips render each row in place inside
+         the pending output block, so the only copy left on our side is
+         the one gimp_pixel_rgn_set_rect makes into the shadow tiles.
+         Sharded strips compute overlap columns that must not reach the
+         block, and previews snapshot outputRow into the cache, so both
+         keep the staging buffer */
+      band->directWrite = preview == NULL &&
+                          outColStart == 0 && outWidth == stripWidth;
+
+      // Warm-started previews skip the rows/columns the cache kept
+      band->warmActive = preview != NULL && MedianWarm.active;
+      if (band->warmActive)
+        {
+          band->warmRowStart = MedianWarm.rowStart;
+          band->warmRowEnd   = MedianWarm.rowEnd;
+          band->warmColStart = MedianWarm.colStart;
+          band->warmColEnd   = MedianWarm.colEnd;
+        }
+
+      /* Per-channel enables from the GUI/PDB mask, trimmed to the
+         channels this drawable actually has */
+      band->channelEnabled = 0;
+      for (ii = 0; ii < channels && ii < 4; ii++)
+        if (UserInputValues.channel[ii])
+          band->channelEnabled |= 1u << ii;
+
+      /* Watch the alpha channel for constancy as rows are fetched in;
+         while every alpha byte seen so far matches, any window median
+         of it equals that byte and the channel can copy through */
+      if (gimp_drawable_has_alpha (drawable->drawable_id))
+        {
+          band->alphaChannel  = channels - 1;
+          band->alphaConstant = TRUE;
+        }
+
+      /* Window seeding happens per chunk in medianSeedWindow; here the
+         column histograms only need to be allocated for the engines
+         that maintain them */
+      if (UserInputValues.separable ||
+          ActiveAlgorithm == MEDIAN_ALGORITHM_CONSTANT_TIME)
+        band->colHists = columnHistogramsNew (stripWidth, channels);
+      else
+        band->colHists = NULL;
+    }
+
+  // Dispatch bands 1..n-1 to worker threads; this thread takes band 0
+  for (b = 1; b < numBands; b++)
+    workers[b] = g_thread_new ("median-band", medianProcessBand, &bands[b]);
+
+  medianProcessBand (&bands[0]);
+
+  for (b = 1; b < numBands; b++)
+    g_thread_join (workers[b]);
+
+  // Free the memory
+  for (b = 0; b < numBands; b++)
+    {
+      if (bands[b].colHists)
+        columnHistogramsFree (bands[b].colHists);
+      for (ii = 0; ii < 2 * UserInputValues.radius + 1; ii++)
+        {
+          g_free (bands[b].inputRow[ii]);
+          g_free (bands[b].hRow[ii]);
+        }
+      for (ii = 0; ii < channels * bands[b].windowRows; ii++)
+        g_free (bands[b].planeRow[ii]);
+      for (ii = 0; ii < channels; ii++)
+        g_free (bands[b].outPlane[ii]);
+      g_free (bands[b].planeRow);
+      g_free (bands[b].inputRow);
+      g_free (bands[b].hRow);
+      g_free (bands[b].outPlane);
+      g_free (bands[b].outputRowStore);
+      g_free (bands[b].windowScratch);
+      g_free (bands[b].ioBlock);
+      g_free (bands[b].outBlock);
+      g_free (bands[b].prefetchBlock);
+      g_free (bands[b].maskRow);
+    }
+  g_free (bands);
+  g_free (workers);
+  g_free (bandRgnIn);
+  g_free (bandRgnOut);
+  g_free (bandRgnMask);
+}
+
+
+/* Strips needed to keep the estimated peak allocation of one strip
+   under the ceiling. The estimate counts the width-proportional terms:
+   the three I/O blocks, the window rows in both layouts, and the
+   column histograms when an engine keeps them */
+static inline gint
+medianShardCount (gint width,
+                  gint channels,
+                  gint numBands)
+{
+  const gchar *env        = g_getenv ("MEDIAN_MEMORY_MB");
+  gint64       ceilingMb  = MEDIAN_SHARD_CEILING_MB;
+  gint         windowRows = 2 * UserInputValues.radius + 1;
+  gint64       perColumn, estimate;
+  gint         numStrips, maxStrips;
+
+  if (env && *env && g_ascii_strtoll (env, NULL, 10) > 0)
+    ceilingMb = g_ascii_strtoll (env, NULL, 10);
+
+  perColumn = (gint64) channels *
+              (3 * MEDIAN_IO_BLOCK_ROWS +  // ioBlock, outBlock, prefetchBlock
+               3 * windowRows +            // inputRow, planeRow, hRow
+               2);                         // outputRow, outPlane
+  if (UserInputValues.separable ||
+      ActiveAlgorithm == MEDIAN_ALGORITHM_CONSTANT_TIME)
+    perColumn += (gint64) channels * (256 + 16) * sizeof (gushort);
+
+  estimate  = (gint64) numBands * width * perColumn;
+  numStrips = (gint) ((estimate + ceilingMb * 1024 * 1024 - 1) /
+                      (ceilingMb * 1024 * 1024));
+
+  /* Don't shard below a useful strip width: the 2r overlap columns are
+     recomputed per strip, and slivers would be mostly overlap */
+  maxStrips = MAX (1, width / (4 * windowRows));
+
+  return CLAMP (numStrips, 1, maxStrips);
+}
+
+
+// -------------------------- //
+//  Stage timing: counters    //
+//  accumulate per band and   //
+//  fold into run totals at   //
+//       each band's end      //
+// -------------------------- //
+static inline void
+medianStatsBegin (void)
+{
+  static gboolean envParsed = FALSE;
+
+  if (! envParsed)
+    {
+      const gchar *env = g_getenv ("MEDIAN_STATS");
+
+      envParsed = TRUE;
+      if (env && *env)
+        {
+          MedianStatsOn = TRUE;
+          if (strcmp (env, "1") != 0)
+            MedianStatsPath = env;
+        }
+    }
+
+  if (! MedianStatsOn)
+    return;
+
+  memset (&MedianStatsTotals, 0, sizeof (MedianStatsTotals));
+  MedianStatsTotals.wallStart = g_get_monotonic_time ();
+}
+
+
+static inline void
+medianStatsFoldBand (MedianBandContext *band)
+{
+  if (! MedianStatsOn)
+    return;
+
+  g_mutex_lock (&MedianStatsMutex);
+  MedianStatsTotals.fetchUs    += band->statFetchUs;
+  MedianStatsTotals.fetchBytes += band->statFetchBytes;
+  MedianStatsTotals.computeUs  += band->statComputeUs;
+  MedianStatsTotals.writeUs    += band->statWriteUs;
+  MedianStatsTotals.writeBytes += band->statWriteBytes;
+  g_mutex_unlock (&MedianStatsMutex);
+
+  band->statFetchUs   = 0;
+  band->statFetchBytes = 0;
+  band->statComputeUs = 0;
+  band->statWriteUs   = 0;
+  band->statWriteBytes = 0;
+}
+
+
+/* Fetch/compute/write split answers the question the totals exist
+   for: whether a slow image is tile-I/O bound or sort bound */
+static inline void
+medianStatsDump (gint width,
+                 gint height,
+                 gint channels)
+{
+  gint64  wallUs;
+  gchar  *line;
+
+  if (! MedianStatsOn)
+    return;
+
+  wallUs = g_get_monotonic_time () - MedianStatsTotals.wallStart;
+  line = g_strdup_printf ("median stats: %dx%d bpp=%d radius=%d algo=%d | "
+                          "wall %.1f ms | fetch %.1f ms (%.2f MB) | "
+                          "compute %.1f ms | write %.1f ms (%.2f MB)",
+                          width, height, channels,
+                          UserInputValues.radius, (gint) ActiveAlgorithm,
+                          wallUs / 1000.0,
+                          MedianStatsTotals.fetchUs / 1000.0,
+                          MedianStatsTotals.fetchBytes / (1024.0 * 1024.0),
+                          MedianStatsTotals.computeUs / 1000.0,
+                          MedianStatsTotals.writeUs / 1000.0,
+                          MedianStatsTotals.writeBytes / (1024.0 * 1024.0));
+
+  if (MedianStatsPath)
+    {
+      FILE *statsFile = fopen (MedianStatsPath, "a");
+
+      if (statsFile)
+        {
+          fprintf (statsFile, "%s\n", line);
+          fclose (statsFile);
+        }
+    }
+  else
+    g_message ("%s", line);
+
+  g_free (line);
+}
+
+
+// -------------------------- //
+//  On-disk memoization: one  //
+//  file per (content, opts)  //
+//  hash, opt-in through the  //
+//   MEDIAN_DISK_CACHE var    //
+// -------------------------- //
+/* Cache directory, resolved once: "1" picks a directory under the
+   user cache dir, any other value is used as the path itself. NULL
+   (and thus no memoization at all) when the variable is unset or the
+   directory cannot be created */
+static inline const gchar *
+medianDiskCacheDir (void)
+{
+  static gchar   *dir      = NULL;
+  static gboolean resolved = FALSE;
+  const gchar    *env;
+
+  if (resolved)
+    return dir;
+  resolved = TRUE;
+
+  env = g_getenv ("MEDIAN_DISK_CACHE");
+  if (! env || ! *env)
+    return NULL;
+
+  dir = strcmp (env, "1") == 0
+          ? g_build_filename (g_get_user_cache_dir (), "gimp-median", NULL)
+          : g_strdup (env);
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      g_free (dir);
+      dir = NULL;
+    }
+
+  return dir;
+}
+
+
+/* SHA-1 over the effective options followed by every input pixel of
+   the region. The engine choice and thread count stay out of the key:
+   the exact engines agree byte for byte regardless of either — the
+   invariant plug-in-median-verify pins — so their results are
+   interchangeable. NULL when memoization is off */
+static inline gchar *
+medianDiskCacheKey (GimpDrawable *drawable,
+                    gint          x1,
+                    gint          y1,
+                    gint          width,
+                    gint          height,
+                    gint          channels)
+{
+  GChecksum   *checksum;
+  GimpPixelRgn rgn;
+  guchar      *block;
+  gchar       *key;
+  gint         row, rows;
+  gint32       params[10];
+
+  if (! medianDiskCacheDir ())
+    return NULL;
+
+  params[0] = UserInputValues.radius;
+  params[1] = UserInputValues.lessThan;
+  params[2] = UserInputValues.greaterThan;
+  params[3] = UserInputValues.button ? 1 : 0;
+  params[4] = UserInputValues.button2 ? 1 : 0;
+  params[5] = UserInputValues.separable ? 1 : 0;
+  params[6] = (gint32) medianChannelMaskKey ();
+  params[7] = width;
+  params[8] = height;
+  params[9] = channels;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  g_checksum_update (checksum, (const guchar *) params, sizeof (params));
+
+  block = g_new (guchar, (gsize) MEDIAN_IO_BLOCK_ROWS * width * channels);
+  gimp_pixel_rgn_init (&rgn, drawable, x1, y1, width, height, FALSE, FALSE);
+
+  for (row = 0; row < height; row += rows)
+    {
+      rows = MIN (MEDIAN_IO_BLOCK_ROWS, height - row);
+      gimp_pixel_rgn_get_rect (&rgn, block, x1, y1 + row, width, rows);
+      g_checksum_update (checksum, block,
+                         (gssize) rows * width * channels);
+    }
+
+  key = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+  g_free (block);
+
+  return key;
+}
+
+
+/* Cache hit: replay the stored result through the shadow region and
+   merge, exactly like a computed run would land. FALSE when there is
+   no usable entry for the key */
+static inline gboolean
+medianDiskCacheLoad (GimpDrawable *drawable,
+                     const gchar  *key,
+                     gint          x1,
+                     gint          y1,
+                     gint          width,
+                     gint          height,
+                     gint          channels)
+{
+  gchar       *file = g_strdup_printf ("%s.raw", key);
+  gchar       *path = g_build_filename (medianDiskCacheDir (), file, NULL);
+  gchar       *data = NULL;
+  gsize        length = 0;
+  GimpPixelRgn rgn;
+  gboolean     usable;
+
+  usable = g_file_get_contents (path, &data, &length, NULL) &&
+           length == (gsize) width * height * channels;
+
+  if (usable)
+    {
+      gimp_pixel_rgn_init (&rgn, drawable,
+                           x1, y1, width, height,
+                           TRUE, TRUE);
+      gimp_pixel_rgn_set_rect (&rgn, (const guchar *) data,
+                               x1, y1, width, height);
+      gimp_drawable_flush (drawable);
+      gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
+      gimp_drawable_update (drawable->drawable_id,
+                            x1, y1, width, height);
+    }
+
+  g_free (data);
+  g_free (path);
+  g_free (file);
+
+  return usable;
+}
+
+
+/* After a completed run the drawable holds the merged result; store
+   it under the key computed from the pre-filter input */
+static inline void
+medianDiskCacheStore (GimpDrawable *drawable,
+                      const gchar  *key,
+                      gint          x1,
+                      gint          y1,
+                      gint          width,
+                      gint          height,
+                      gint          channels)
+{
+  gchar       *file = g_strdup_printf ("%s.raw", key);
+  gchar       *path = g_build_filename (medianDiskCacheDir (), file, NULL);
+  gsize        numBytes = (gsize) width * height * channels;
+  guchar      *data = g_new (guchar, numBytes);
+  GimpPixelRgn rgn;
+
+  gimp_pixel_rgn_init (&rgn, drawable,
+                       x1, y1, width, height,
+                       FALSE, FALSE);
+  gimp_pixel_rgn_get_rect (&rgn, data, x1, y1, width, height);
+
+  g_file_set_contents (path, (const gchar *) data, (gssize) numBytes, NULL);
+
+  g_free (data);
+  g_free (path);
+  g_free (file);
+}
+
+
+// -------------------------- //
+//  Preview median cache: the //
+//  raw medians survive until //
+//  the region, radius or the //
+//      engine changes        //
+// -------------------------- //
+/* The four channel enables folded into one comparable key */
+static inline guint
+medianChannelMaskKey (void)
+{
+  return (UserInputValues.channel[0] ? 1u : 0) |
+         (UserInputValues.channel[1] ? 2u : 0) |
+         (UserInputValues.channel[2] ? 4u : 0) |
+         (UserInputValues.channel[3] ? 8u : 0);
+}
+
+
+static inline gboolean
+medianCacheMatches (gint x1,
+                    gint y1,
+                    gint width,
+                    gint height,
+                    gint channels)
+{
+  return MedianCache.valid &&
+         MedianCache.x1        == x1 &&
+         MedianCache.y1        == y1 &&
+         MedianCache.width     == width &&
+         MedianCache.height    == height &&
+         MedianCache.channels  == channels &&
+         MedianCache.radius    == UserInputValues.radius &&
+         MedianCache.algorithm == ActiveAlgorithm &&
+         MedianCache.separable == UserInputValues.separable &&
+         MedianCache.channelMask == medianChannelMaskKey ();
+}
+
+
+/* (Re)sizes the cache buffers for the coming preview run and records
+   the key; valid stays FALSE until the run has filled them */
+static inline void
+medianCachePrepare (gint x1,
+                    gint y1,
+                    gint width,
+                    gint height,
+                    gint channels)
+{
+  gsize numSamples = (gsize) width * height * channels;
+
+  if (! MedianCache.medianRows ||
+      (gsize) MedianCache.width * MedianCache.height * MedianCache.channels
+        != numSamples)
+    {
+      g_free (MedianCache.medianRows);
+      g_free (MedianCache.centerRows);
+      MedianCache.medianRows = g_new (guchar, numSamples);
+      MedianCache.centerRows = g_new (guchar, numSamples);
+    }
+
+  MedianCache.x1        = x1;
+  MedianCache.y1        = y1;
+  MedianCache.width     = width;
+  MedianCache.height    = height;
+  MedianCache.channels  = channels;
+  MedianCache.radius    = UserInputValues.radius;
+  MedianCache.algorithm = ActiveAlgorithm;
+  MedianCache.separable = UserInputValues.separable;
+  MedianCache.channelMask = medianChannelMaskKey ();
+  MedianCache.valid     = FALSE;
+}
+
+
+/* Pan warm start: when only the viewport origin changed, shift the
+   overlapping part of the cached medians and centre rows to their new
+   position and record the still-valid rect, so the coming run skips
+   it. Sides where the old viewport border is now interior are shrunk
+   by the radius — those cached pixels saw the old border clamping.
+   Sides on the new border keep the old values; the preview clamps at
+   its borders anyway, so the quality there is unchanged */
+static inline void
+medianCacheWarmStart (gint x1,
+                      gint y1,
+                      gint width,
+                      gint height,
+                      gint channels)
+{
+  gint  r  = UserInputValues.radius;
+  gint  dx, dy;
+  gint  colLo, colHi, rowLo, rowHi;
+  gint  row;
+  gsize rowBytes = (gsize) width * channels;
+
+  MedianWarm.active = FALSE;
+
+  // Same parameters and viewport size, different origin — a pan
+  if (! MedianCache.valid ||
+      MedianCache.width      != width                   ||
+      MedianCache.height     != height                  ||
+      MedianCache.channels   != channels                ||
+      MedianCache.radius     != UserInputValues.radius  ||
+      MedianCache.algorithm  != ActiveAlgorithm         ||
+      MedianCache.separable  != UserInputValues.separable ||
+      MedianCache.channelMask != medianChannelMaskKey ())
+    return;
+
+  dx = x1 - MedianCache.x1;   // new origin in old-viewport coordinates
+  dy = y1 - MedianCache.y1;
+
+  // Overlap rect in new-viewport coordinates
+  colLo = MAX (0, -dx);
+  colHi = MIN (width, width - dx);
+  rowLo = MAX (0, -dy);
+  rowHi = MIN (height, height - dy);
+
+  // Drop the r pixels that carry old-border clamping into the interior
+  if (dx < 0)
+    colLo += r;
+  if (dx > 0)
+    colHi -= r;
+  if (dy < 0)
+    rowLo += r;
+  if (dy > 0)
+    rowHi -= r;
+
+  if (colHi <= colLo || rowHi <= rowLo)
+    return;
+
+  /* Shift in place; the row walk order keeps the source ahead of the
+     destination whichever way the pan went */
+  for (row = (dy >= 0) ? rowLo : rowHi - 1;
+       (dy >= 0) ? (row < rowHi) : (row >= rowLo);
+       (dy >= 0) ? row++ : row--)
+    {
+      gsize dst = (gsize) row * rowBytes + (gsize) colLo * channels;
+      gsize src = (gsize) (row + dy) * rowBytes +
+                  (gsize) (colLo + dx) * channels;
+      gsize len = (gsize) (colHi - colLo) * channels;
+
+      memmove (MedianCache.medianRows + dst,
+               MedianCache.medianRows + src, len);
+      memmove (MedianCache.centerRows + dst,
+               MedianCache.centerRows + src, len);
+    }
+
+  MedianWarm.active   = TRUE;
+  MedianWarm.rowStart = rowLo;
+  MedianWarm.rowEnd   = rowHi;
+  MedianWarm.colStart = colLo;
+  MedianWarm.colEnd   = colHi;
+}
+
+
+/* Cache hit: the windowed medians are already known, so only the
+   variant threshold pass runs — over the whole region at once, since
+   the filters are elementwise over interleaved samples */
+static inline void
+medianCacheApplyVariant (GimpDrawable *drawable,
+                         GimpPreview  *preview)
+{
+  GimpPixelRgn rgnOut;
+  gint         numSamples = MedianCache.width * MedianCache.height *
+                            MedianCache.channels;
+  guchar      *out = g_new (guchar, numSamples);
+
+  memcpy (out, MedianCache.medianRows, numSamples);
+  if (ActiveVariantFilter)
+    ActiveVariantFilter (out, MedianCache.centerRows, numSamples);
+
+  gimp_pixel_rgn_init (&rgnOut, drawable,
+                       MedianCache.x1, MedianCache.y1,
+                       MedianCache.width, MedianCache.height,
+                       FALSE, TRUE);
+  gimp_pixel_rgn_set_rect (&rgnOut, out,
+                           MedianCache.x1, MedianCache.y1,
+                           MedianCache.width, MedianCache.height);
+  g_free (out);
+
+  gimp_drawable_preview_draw_region (GIMP_DRAWABLE_PREVIEW (preview),
+                                     &rgnOut);
+}
+
+
+// -------------------------- //
+//  Progressive preview: the  //
+//  coarse first pass filters //
+//  a downsampled copy of the //
+//       preview region       //
+// -------------------------- //
+/* Windowed median of an in-memory interleaved buffer; CLAMP'ed gather
+   plus qsort, picking the same rank as the main qsort engine. Only
+   ever runs on the downsampled copy, where the brute force is cheap */
+static inline void
+medianFilterCoarseBuffer (const guchar *src,
+                          guchar       *dst,
+                          gint          width,
+                          gint          height,
+                          gint          channels,
+                          gint          radius)
+{
+  gint    oneDimension = 2 * radius + 1;
+  gint    numberOfPixels = SQR (oneDimension);
+  gint    mid = numberOfPixels / 2;
+  guchar *window = g_new (guchar, numberOfPixels);
+  gint    i, j, k, ii, jj;
+
+  for (i = 0; i < height; i++)
+    for (j = 0; j < width; j++)
+      for (k = 0; k < channels; k++)
+        {
+          gint index = 0;
+
+          for (ii = -radius; ii <= radius; ii++)
+            for (jj = -radius; jj <= radius; jj++)
+              window[index++] =
+                src[channels * (CLAMP (i + ii, 0, height - 1) * width +
+                                CLAMP (j + jj, 0, width - 1)) + k];
+
+          qsort (window, numberOfPixels, sizeof (guchar), compareNumbers);
+          dst[channels * (i * width + j) + k] = window[mid + 1];
+        }
+
+  g_free (window);
+}
+
+
+/* Filters a 2x or 4x downsampled copy of the preview region with the
+   radius scaled to match, upsamples the result and draws it straight
+   into the preview widget — roughly factor^3 cheaper than the exact
+   pass, so the retoucher sees the effect of a radius change at once
+   while the full-resolution refinement grinds on behind it */
+static inline void
+medianPreviewQuickPass (GimpDrawable *drawable,
+                        GimpPreview  *preview,
+                        gint          x1,
+                        gint          y1,
+                        gint          width,
+                        gint          height,
+                        gint          channels)
+{
+  GimpPixelRgn rgnIn;
+  gint         factor = (UserInputValues.radius >= 8) ? 4 : 2;
+  gint         coarseWidth  = MAX (1, width / factor);
+  gint         coarseHeight = MAX (1, height / factor);
+  gint         coarseRadius = MAX (1, UserInputValues.radius / factor);
+  guchar      *input, *coarse, *coarseOut, *out;
+  gint         i, j, k;
+
+  gimp_pixel_rgn_init (&rgnIn, drawable, x1, y1, width, height,
+                       FALSE, FALSE);
+
+  input     = g_new (guchar, (gsize) width * height * channels);
+  coarse    = g_new (guchar, (gsize) coarseWidth * coarseHeight * channels);
+  coarseOut = g_new (guchar, (gsize) coarseWidth * coarseHeight * channels);
+  out       = g_new (guchar, (gsize) width * height * channels);
+
+  gimp_pixel_rgn_get_rect (&rgnIn, input, x1, y1, width, height);
+
+  // Point-sample down; box averaging would soften what the median keeps
+  for (i = 0; i < coarseHeight; i++)
+    for (j = 0; j < coarseWidth; j++)
+      for (k = 0; k < channels; k++)
+        coarse[channels * (i * coarseWidth + j) + k] =
+          input[channels * (i * factor * width + j * factor) + k];
+
+  medianFilterCoarseBuffer (coarse, coarseOut,
+                            coarseWidth, coarseHeight, channels,
+                            coarseRadius);
+
+  // Nearest-neighbour back up to the preview resolution
+  for (i = 0; i < height; i++)
+    for (j = 0; j < width; j++)
+      for (k = 0; k < channels; k++)
+        out[channels * (i * width + j) + k] =
+          coarseOut[channels * (MIN (i / factor, coarseHeight - 1) * coarseWidth +
+                                MIN (j / factor, coarseWidth - 1)) + k];
+
+  // The variant pass compares against the true full-resolution pixels
+  if (ActiveVariantFilter)
+    ActiveVariantFilter (out, input, width * height * channels);
+
+  gimp_preview_draw_buffer (preview, out, width * channels);
+
+  // Let the widget actually repaint before the exact pass hogs the loop
+  while (gtk_events_pending ())
+    gtk_main_iteration ();
+
+  g_free (input);
+  g_free (coarse);
+  g_free (coarseOut);
+  g_free (out);
+}
+
+
+#ifdef HAVE_OPENCL
+// -------------------------- //
+//  OpenCL offload: a whole   //
+//  band per launch, falling  //
+//  back to the CPU path on   //
+//      any device error      //
+// -------------------------- //
+/* Per-pixel rank-from-histogram kernel: each work item builds a
+   private 256-bin histogram of its clamped window and scans to the
+   same rank the CPU engines use over the same centred window, so the
+   output is byte-identical; plug-in-median-verify pins that identity */
+static const char *MedianClSource =
+  "__kernel void median_rank (__global const uchar *in,\n"
+  "                           __global uchar *out,\n"
+  "                           int width, int rows, int channels,\n"
+  "                           int radius, int targetRank)\n"
+  "{\n"
+  "  int x = get_global_id (0);\n"
+  "  int y = get_global_id (1);\n"
+  "  int k = get_global_id (2);\n"
+  "  if (x >= width || y >= rows || k >= channels)\n"
+  "    return;\n"
+  "  ushort hist[256];\n"
+  "  for (int b = 0; b < 256; b++)\n"
+  "    hist[b] = 0;\n"
+  "  for (int ii = 0; ii <= 2 * radius; ii++)\n"
+  "    for (int jj = 0; jj <= 2 * radius; jj++)\n"
+  "      {\n"
+  "        int sx = clamp (x + jj - radius, 0, width - 1);\n"
+  "        hist[in[((y + ii) * width + sx) * channels + k]]++;\n"
+  "      }\n"
+  "  int count = 0;\n"
+  "  uchar med = 0;\n"
+  "  for (int b = 0; b < 256; b++)\n"
+  "    {\n"
+  "      count += hist[b];\n"
+  "      if (count >= targetRank) { med = (uchar) b; break; }\n"
+  "    }\n"
+  "  out[(y * width + x) * channels + k] = med;\n"
+  "}\n";
+
+/* One context/queue/kernel per process, probed lazily and serialized
+   through its own mutex — bands share the device */
+static cl_context       MedianClContext = NULL;
+static cl_command_queue MedianClQueue   = NULL;
+static cl_kernel        MedianClKernel  = NULL;
+static gboolean         MedianClTried   = FALSE;
+static GMutex           MedianClMutex;
+
+static inline gboolean
+medianOpenClAvailable (void)
+{
+  cl_platform_id platform;
+  cl_device_id   device;
+  cl_program     program;
+  cl_int         err;
+
+  if (MedianClTried)
+    return MedianClKernel != NULL;
+  MedianClTried = TRUE;
+
+  if (clGetPlatformIDs (1, &platform, NULL) != CL_SUCCESS ||
+      clGetDeviceIDs (platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL)
+        != CL_SUCCESS)
+    return FALSE;
+
+  MedianClContext = clCreateContext (NULL, 1, &device, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+    return FALSE;
+
+  MedianClQueue = clCreateCommandQueue (MedianClContext, device, 0, &err);
+  if (err != CL_SUCCESS)
+    return FALSE;
+
+  program = clCreateProgramWithSource (MedianClContext, 1,
+                                       &MedianClSource, NULL, &err);
+  if (err != CL_SUCCESS ||
+      clBuildProgram (program, 1, &device, "", NULL, NULL) != CL_SUCCESS)
+    return FALSE;
+
+  MedianClKernel = clCreateKernel (program, "median_rank", &err);
+  if (err != CL_SUCCESS)
+    MedianClKernel = NULL;
+
+  return MedianClKernel != NULL;
+}
+
+
+/* Uploads the vertically padded input of one band, runs the kernel
+   over every (pixel, channel) and plays the readback through the
+   usual per-row tail: disabled-channel copy-through, cache snapshot,
+   variant pass and block writes. FALSE means the caller should do the
+   band on the CPU instead; nothing has been written in that case */
+static inline gboolean
+medianProcessBandOpenCL (MedianBandContext *band)
+{
+  gint    r          = UserInputValues.radius;
+  gint    bandRows   = band->bandEnd - band->bandStart;
+  gint    paddedRows = bandRows + 2 * r;
+  gsize   rowBytes   = (gsize) band->width * band->channels;
+  guint   fullMask   = (1u << band->channels) - 1;
+  guchar *hostIn     = g_new (guchar, (gsize) paddedRows * rowBytes);
+  guchar *hostOut    = g_new (guchar, (gsize) bandRows * rowBytes);
+  cl_mem  devIn = NULL, devOut = NULL;
+  cl_int  err;
+  cl_int  clWidth    = band->width;
+  cl_int  clRows     = bandRows;
+  cl_int  clChannels = band->channels;
+  cl_int  clRadius   = r;
+  cl_int  clRank     = SQR (band->windowRows) / 2 + 2;
+  size_t  global[3]  = { (size_t) band->width,
+                         (size_t) bandRows,
+                         (size_t) band->channels };
+  gint    i, j, k;
+
+  for (i = 0; i < paddedRows; i++)
+    fetchRowBanded (band,
+                    CLAMP (band->bandStart - r + i, 0, band->height - 1),
+                    hostIn + (gsize) i * rowBytes);
+
+  g_mutex_lock (&MedianClMutex);
+
+  devIn = clCreateBuffer (MedianClContext,
+                          CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          (gsize) paddedRows * rowBytes, hostIn, &err);
+  if (err == CL_SUCCESS)
+    devOut = clCreateBuffer (MedianClContext, CL_MEM_WRITE_ONLY,
+                             (gsize) bandRows * rowBytes, NULL, &err);
+
+  if (err == CL_SUCCESS)
+    {
+      err  = clSetKernelArg (MedianClKernel, 0, sizeof (cl_mem), &devIn);
+      err |= clSetKernelArg (MedianClKernel, 1, sizeof (cl_mem), &devOut);
+      err |= clSetKernelArg (MedianClKernel, 2, sizeof (cl_int), &clWidth);
+      err |= clSetKernelArg (MedianClKernel, 3, sizeof (cl_int), &clRows);
+      err |= clSetKernelArg (MedianClKernel, 4, sizeof (cl_int), &clChannels);
+      err |= clSetKernelArg (MedianClKernel, 5, sizeof (cl_int), &clRadius);
+      err |= clSetKernelArg (MedianClKernel, 6, sizeof (cl_int), &clRank);
+    }
+  if (err == CL_SUCCESS)
+    err = clEnqueueNDRangeKernel (MedianClQueue, MedianClKernel, 3,
+                                  NULL, global, NULL, 0, NULL, NULL);
+  if (err == CL_SUCCESS)
+    err = clEnqueueReadBuffer (MedianClQueue, devOut, CL_TRUE, 0,
+                               (gsize) bandRows * rowBytes, hostOut,
+                               0, NULL, NULL);
+
+  if (devIn)
+    clReleaseMemObject (devIn);
+  if (devOut)
+    clReleaseMemObject (devOut);
+
+  g_mutex_unlock (&MedianClMutex);
+
+  if (err != CL_SUCCESS)
+    {
+      g_free (hostIn);
+      g_free (hostOut);
+      return FALSE;
+    }
+
+  for (i = 0; i < bandRows; i++)
+    {
+      const guchar *centreRow = hostIn + (gsize) (i + r) * rowBytes;
+
+      memcpy (band->outputRow, hostOut + (gsize) i * rowBytes, rowBytes);
+
+      // Statically disabled channels copy through, same as the CPU path
+      if ((band->channelEnabled & fullMask) != fullMask)
+        for (k = 0; k < band->channels; k++)
+          if (! (band->channelEnabled & (1u << k)))
+            for (j = 0; j < band->width; j++)
+              band->outputRow[band->channels * j + k] =
+                centreRow[band->channels * j + k];
+
+      if (band->cacheMedianRows)
+        {
+          gsize offset = (gsize) (band->bandStart + i) * rowBytes;
+
+          memcpy (band->cacheMedianRows + offset, band->outputRow, rowBytes);
+          memcpy (band->cacheCenterRows + offset, centreRow, rowBytes);
+        }
+
+      if (ActiveVariantFilter)
+        ActiveVariantFilter (band->outputRow, centreRow,
+                             band->width * band->channels);
+
+      writeRowBanded (band, band->outputRow);
+      g_atomic_int_inc (&RowsDone);
+
+      if (g_atomic_int_get (&MedianCancelRequested))
+        break;
+
+      if (band->reportProgress &&
+          g_get_monotonic_time () - LastProgressTime >=
+            MEDIAN_PROGRESS_INTERVAL_US)
+        {
+          LastProgressTime = g_get_monotonic_time ();
+
+          g_mutex_lock (&TileAccessMutex);
+          gimp_progress_update (((gdouble) ProgressLayerIndex +
+                                 (gdouble) g_atomic_int_get (&RowsDone) /
+                                 (gdouble) TotalRows) /
+                                (gdouble) ProgressLayerCount);
+          g_mutex_unlock (&TileAccessMutex);
+        }
+    }
+
+  flushOutputBlock (band);
+
+  if (band->prefetchThread)
+    {
+      g_thread_join (band->prefetchThread);
+      band->prefetchThread = NULL;
+    }
+
+  g_free (hostIn);
+  g_free (hostOut);
+
+  return TRUE;
+}
+#endif /* HAVE_OPENCL */
+
+
+// -------------------------- //
+//  Worker entry point: pulls //
+//  row chunks off the shared //
+//  counter until the strip   //
+//        runs out            //
+// -------------------------- //
+/* Dynamic scheduling instead of fixed per-worker bands: row cost is
+   far from uniform (unselected spans, constant alpha, flat content),
+   so a worker whose chunks happen to be cheap simply takes more of
+   them. Each chunk re-seeds its own window, which is why chunks span
+   many window heights */
+static inline gpointer
+medianProcessBand (gpointer data)
+{
+  MedianBandContext *band = data;
+
+  for (;;)
+    {
+      gint chunk = g_atomic_int_add (&MedianNextChunk, 1);
+      gint start = chunk * MedianChunkRows;
+
+      if (start >= band->height ||
+          g_atomic_int_get (&MedianCancelRequested))
+        break;
+
+      band->bandStart = start;
+      band->bandEnd   = MIN (start + MedianChunkRows, band->height);
+
+      /* Position the output block at the chunk's first row before any
+         engine — GPU or CPU — renders into it */
+      band->outBlockStart = band->bandStart;
+      band->outBlockRows  = 0;
+      if (band->directWrite)
+        band->outputRow = band->outBlock;
+
+#ifdef HAVE_OPENCL
+      /* The GPU engine offloads whole chunks; selections with a mask
+         keep the row-based CPU path, which knows about spans, and
+         separable runs stay on the CPU too — the kernel computes the
+         exact 2-D rank, not the opted-into approximation. A device
+         failure mid-run simply drops through to the CPU loop below */
+      if (ActiveAlgorithm == MEDIAN_ALGORITHM_OPENCL &&
+          ! band->rgn_mask && ! UserInputValues.separable &&
+          medianProcessBandOpenCL (band))
+        continue;
+#endif
+
+      medianSeedWindow (band);
+      medianProcessChunk (band);
+    }
+
+  // Collect a read-ahead the worker finished without needing
+  if (band->prefetchThread)
+    {
+      g_thread_join (band->prefetchThread);
+      band->prefetchThread = NULL;
+    }
+
+  medianStatsFoldBand (band);
+
+  return NULL;
+}
+
+
+/* (Re)builds the sliding window state at the top of band->bandStart:
+   the 2r+1 input rows, their channel planes, and the column histograms
+   of the engines that keep them */
+static inline void
+medianSeedWindow (MedianBandContext *band)
+{
+  gint ii;
+
+  for (ii = -UserInputValues.radius; ii <= UserInputValues.radius; ii++)
+    {
+      fetchRowBanded (band,
+                      CLAMP (band->bandStart + ii, 0, band->height - 1),
+                      band->inputRow[UserInputValues.radius + ii]);
+      deinterleavePlaneRow (band, UserInputValues.radius + ii);
+    }
+
+  if (UserInputValues.separable)
+    {
+      columnHistogramsReset (band->colHists);
+      for (ii = 0; ii < band->windowRows; ii++)
+        {
+          medianFilterRowHorizontal (band, ii);
+          columnHistogramsAddRow (band->colHists, band->hRow[ii]);
+        }
+    }
+  else if (band->colHists)
+    {
+      columnHistogramsReset (band->colHists);
+      for (ii = 0; ii < band->windowRows; ii++)
+        columnHistogramsAddRow (band->colHists, band->inputRow[ii]);
+    }
+}
+
+
+/* The row loop over one seeded chunk */
+static inline void
+medianProcessChunk (MedianBandContext *band)
+{
+  gint i;
+
+  for (i = band->bandStart; i < band->bandEnd; i++)
+    {
+      /* A fully unselected row just passes the centre row through; the
+         window still has to keep sliding below so later rows see the
+         right neighbourhood */
+      band->cacheRow = i;
+
+      if (updateSelectedSpan (band, i))
+        {
+          gint64 statT0 = MedianStatsOn ? g_get_monotonic_time () : 0;
+
+          handleInputRow (band);  // Perform the actual median filtering
+
+          if (MedianStatsOn)
+            band->statComputeUs += g_get_monotonic_time () - statT0;
+        }
+      else
+        memcpy (band->outputRow,
+                band->inputRow[UserInputValues.radius],
+                band->width * band->channels);
+
+      // Append the finished row to the pending output block
+      writeRowBanded (band, band->outputRow);
+
+      // The topmost row leaves the window before the shuffle overwrites it
+      if (band->colHists)
+        columnHistogramsRemoveRow (band->colHists,
+                                   UserInputValues.separable
+                                     ? band->hRow[0]
+                                     : band->inputRow[0]);
+
+      // Shift tile rows to insert the new one at the end
+      shuffle_tile_rows (band, i);
+
+      // ...and the freshly fetched bottom row enters it
+      if (band->colHists)
+        columnHistogramsAddRow (band->colHists,
+                                UserInputValues.separable
+                                  ? band->hRow[band->windowRows - 1]
+                                  : band->inputRow[2 * UserInputValues.radius]);
+
+      g_atomic_int_inc (&RowsDone);
+
+      /* Preview passes pump the main loop periodically so a newer
+         widget change can reach us and cancel this pass mid-run */
+      if (band->cacheMedianRows && i % 16 == 0)
+        {
+          while (gtk_events_pending ())
+            gtk_main_iteration ();
+        }
+
+      // Every band honours a cancellation request between rows
+      if (g_atomic_int_get (&MedianCancelRequested))
+        break;
+
+      /* Update progress bar in GIMP's GUI, aggregated over all bands
+         and paced by wall time rather than row count */
+      if (band->reportProgress &&
+          g_get_monotonic_time () - LastProgressTime >=
+            MEDIAN_PROGRESS_INTERVAL_US)
+        {
+          LastProgressTime = g_get_monotonic_time ();
+
+          g_mutex_lock (&TileAccessMutex);
+          gimp_progress_update (((gdouble) ProgressLayerIndex +
+                                 (gdouble) g_atomic_int_get (&RowsDone) /
+                                 (gdouble) TotalRows) /
+                                (gdouble) ProgressLayerCount);
+          g_mutex_unlock (&TileAccessMutex);
+        }
+    }
+
+  // Push out whatever the last partial block holds
+  flushOutputBlock (band);
+}
+
+
+// -------------------------- //
+//  Banded tile I/O: rows are //
+//  read and written in rect  //
+//  blocks so the tile layer  //
+//  is crossed once per block //
+// -------------------------- //
+/* Entry point of the read-ahead: pulls the next block of rows into
+   prefetchBlock while the band thread keeps computing on ioBlock */
+static inline gpointer
+medianPrefetchBlock (gpointer data)
+{
+  MedianBandContext *band = data;
+
+  g_mutex_lock (&TileAccessMutex);
+  gimp_pixel_rgn_get_rect (band->rgn_in,
+                           band->prefetchBlock,
+                           band->x1, band->y1 + band->prefetchStart,
+                           band->width, band->prefetchRows);
+  g_mutex_unlock (&TileAccessMutex);
+
+  return NULL;
+}
+
+
+static inline void
+fetchRowBanded (MedianBandContext *band,
+                gint               row,
+                guchar            *buf)
+{
+  gint   rowBytes = band->width * band->channels;
+  gint64 statT0   = MedianStatsOn ? g_get_monotonic_time () : 0;
+
+  /* Row fetches within a band are monotonically increasing, so a miss
+     simply starts the next block at the requested row */
+  if (band->ioBlockStart < 0 ||
+      row < band->ioBlockStart ||
+      row >= band->ioBlockStart + band->ioBlockRows)
+    {
+      // Collect the read-ahead first; usually it is exactly what we need
+      if (band->prefetchThread)
+        {
+          g_thread_join (band->prefetchThread);
+          band->prefetchThread = NULL;
+
+          if (band->prefetchStart == row)
+            {
+              guchar *swap = band->ioBlock;
+
+              band->ioBlock       = band->prefetchBlock;
+              band->prefetchBlock = swap;
+              band->ioBlockStart  = band->prefetchStart;
+              band->ioBlockRows   = band->prefetchRows;
+            }
+        }
+
+      // Still missing (first block, or a clamped re-read): fetch in line
+      if (band->ioBlockStart < 0 ||
+          row < band->ioBlockStart ||
+          row >= band->ioBlockStart + band->ioBlockRows)
+        {
+          band->ioBlockStart = row;
+          band->ioBlockRows  = MIN (MEDIAN_IO_BLOCK_ROWS, band->height - row);
+
+          g_mutex_lock (&TileAccessMutex);
+          gimp_pixel_rgn_get_rect (band->rgn_in,
+                                   band->ioBlock,
+                                   band->x1, band->y1 + row,
+                                   band->width, band->ioBlockRows);
+          g_mutex_unlock (&TileAccessMutex);
+        }
+
+      /* Kick off the next read-ahead so the tile swap-in of the
+         following block overlaps with computing this one */
+      if (band->ioBlockStart + band->ioBlockRows < band->height)
+        {
+          band->prefetchStart  = band->ioBlockStart + band->ioBlockRows;
+          band->prefetchRows   = MIN (MEDIAN_IO_BLOCK_ROWS,
+                                      band->height - band->prefetchStart);
+          band->prefetchThread = g_thread_new ("median-prefetch",
+                                               medianPrefetchBlock, band);
+        }
+    }
+
+  memcpy (buf,
+          band->ioBlock + (gsize) (row - band->ioBlockStart) * rowBytes,
+          rowBytes);
+
+  if (MedianStatsOn)
+    {
+      band->statFetchUs    += g_get_monotonic_time () - statT0;
+      band->statFetchBytes += rowBytes;
+    }
+
+  // Every row enters the window through here, so watch alpha as it goes
+  medianTrackAlphaRow (band, buf);
+}
+
+
+/* Keeps alphaConstant true exactly while every alpha byte fetched so
+   far carries the same value; one width-long scan per row, trivially
+   cheaper than median-filtering the channel */
+static inline void
+medianTrackAlphaRow (MedianBandContext *band,
+                     const guchar      *row)
+{
+  gint j;
+
+  if (band->alphaChannel < 0 || ! band->alphaConstant)
+    return;
+
+  if (! band->alphaSeen)
+    {
+      band->alphaValue = row[band->alphaChannel];
+      band->alphaSeen  = TRUE;
+    }
+
+  for (j = 0; j < band->width; j++)
+    if (row[band->channels * j + band->alphaChannel] != band->alphaValue)
+      {
+        band->alphaConstant = FALSE;
+        return;
+      }
+}
+
+
+/* Packs only the columns this strip owns into the output block; in
+   the common single-strip case that is the whole row. On the direct
+   path the row was already rendered in place and buf aliases the
+   block slot, so only the bookkeeping remains */
+static inline void
+writeRowBanded (MedianBandContext *band,
+                const guchar      *buf)
+{
+  gint rowBytes = band->outWidth * band->channels;
+
+  if (! band->directWrite)
+    memcpy (band->outBlock + (gsize) band->outBlockRows * rowBytes,
+            buf + (gsize) band->outColStart * band->channels, rowBytes);
+  band->outBlockRows++;
+
+  if (band->outBlockRows == MEDIAN_IO_BLOCK_ROWS)
+    flushOutputBlock (band);
+
+  // Aim outputRow at the slot the next row will occupy
+  if (band->directWrite)
+    band->outputRow = band->outBlock + (gsize) band->outBlockRows * rowBytes;
+}
+
+
+static inline void
+flushOutputBlock (MedianBandContext *band)
+{
+  gint64 statT0 = MedianStatsOn ? g_get_monotonic_time () : 0;
+
+  if (band->outBlockRows == 0)
+    return;
+
+  g_mutex_lock (&TileAccessMutex);
+  gimp_pixel_rgn_set_rect (band->rgn_out,
+                           band->outBlock,
+                           band->x1 + band->outColStart,
+                           band->y1 + band->outBlockStart,
+                           band->outWidth, band->outBlockRows);
+  g_mutex_unlock (&TileAccessMutex);
+
+  if (MedianStatsOn)
+    {
+      band->statWriteUs    += g_get_monotonic_time () - statT0;
+      band->statWriteBytes += (gint64) band->outBlockRows *
+                              band->outWidth * band->channels;
+    }
+
+  band->outBlockStart += band->outBlockRows;
+  band->outBlockRows   = 0;
+}
+
+
+// -------------------------- //
+//  Reads one mask row and    //
+//  trims the row loop to its //
+//  selected span; FALSE when //
+//  nothing is selected       //
+// -------------------------- //
+static inline gboolean
+updateSelectedSpan (MedianBandContext *band,
+                    gint               row)
+{
+  gint first, last;
+
+  /* Warm-started preview: rows inside the still-valid cache rect only
+     recompute the columns the pan exposed (always one contiguous side
+     by construction). The window keeps sliding over skipped rows so
+     later dirty rows see the right neighbourhood */
+  if (band->warmActive &&
+      row >= band->warmRowStart && row < band->warmRowEnd)
+    {
+      if (band->warmColStart <= 0 && band->warmColEnd >= band->width)
+        {
+          band->spanStart = 0;
+          band->spanEnd   = 0;
+          return FALSE;       // whole row still valid
+        }
+      if (band->warmColStart <= 0)
+        {
+          band->spanStart = band->warmColEnd;
+          band->spanEnd   = band->width;
+          return TRUE;
+        }
+      if (band->warmColEnd >= band->width)
+        {
+          band->spanStart = 0;
+          band->spanEnd   = band->warmColStart;
+          return TRUE;
+        }
+    }
+
+  if (! band->rgn_mask)
+    {
+      band->spanStart = 0;
+      band->spanEnd   = band->width;
+      return TRUE;
+    }
+
+  fetchRowLocked (band->rgn_mask, band->maskRow,
+                  band->maskX, band->maskY + row, band->width);
+
+  /* Any nonzero coverage counts as selected — merge_shadow applies the
+     mask weighting afterwards, exactly as the full-width path relied on */
+  for (first = 0; first < band->width; first++)
+    if (band->maskRow[first])
+      break;
+
+  if (first == band->width)
+    {
+      band->spanStart = 0;
+      band->spanEnd   = 0;
+      return FALSE;
+    }
+
+  for (last = band->width - 1; last > first; last--)
+    if (band->maskRow[last])
+      break;
+
+  band->spanStart = first;
+  band->spanEnd   = last + 1;
+  return TRUE;
+}
+
+
+// -------------------------- //
+//  Tile row I/O serialized   //
+//   through TileAccessMutex  //
+// -------------------------- //
+static inline void
+fetchRowLocked (GimpPixelRgn *rgn,
+                guchar       *buf,
+                gint          x,
+                gint          y,
+                gint          width)
+{
+  g_mutex_lock (&TileAccessMutex);
+  gimp_pixel_rgn_get_row (rgn, buf, x, y, width);
+  g_mutex_unlock (&TileAccessMutex);
+}
+
+
+// -------------------------- //
+// Allocates memory for input //
+//  and output rows plus the  //
+//  padded per-channel planes //
+// -------------------------- //
+static inline void
+initializeMemory (MedianBandContext *band)
+{
+  gint i;
+
+  band->windowRows  = 2 * UserInputValues.radius + 1;
+  band->paddedWidth = band->width + 2 * UserInputValues.radius;
+
+  // Allocate memory for one input row
+  band->inputRow = g_new (guchar*, band->windowRows);
+
+  // Now go from bottom to top and allocate enough memory for all input rows in input matrix
+  for (i = 0; i < band->windowRows; i++)
+  {
+    band->inputRow[i] = g_new (guchar, band->width * band->channels);
+  }
+  // Allocate memory for output row (need only enough for one)
+  band->outputRowStore = g_new (guchar, band->width * band->channels);
+  band->outputRow      = band->outputRowStore;
+  band->directWrite    = FALSE;
+
+  /* Planar mirror of the row window: each channel gets its own copy of
+     every window row, padded by r replicated pixels on either side
+     (plus lane slack for the vector engine), so the hot gathers become
+     clamp-free unit-stride walks instead of strided CLAMP'ed loads */
+  band->planeRow = g_new (guchar*, band->channels * band->windowRows);
+  for (i = 0; i < band->channels * band->windowRows; i++)
+    band->planeRow[i] = g_new0 (guchar, band->paddedWidth + MEDIAN_VEC_WIDTH);
+
+  // Banded I/O buffers: one block of input rows, one of output rows
+  band->ioBlock       = g_new (guchar, (gsize) MEDIAN_IO_BLOCK_ROWS *
+                                       band->width * band->channels);
+  band->outBlock      = g_new (guchar, (gsize) MEDIAN_IO_BLOCK_ROWS *
+                                       band->width * band->channels);
+  band->ioBlockStart  = -1;
+  band->ioBlockRows   = 0;
+  band->outBlockStart = band->bandStart;
+  band->outBlockRows  = 0;
+
+  // Second input block for the asynchronous read-ahead
+  band->prefetchBlock  = g_new (guchar, (gsize) MEDIAN_IO_BLOCK_ROWS *
+                                        band->width * band->channels);
+  band->prefetchStart  = -1;
+  band->prefetchRows   = 0;
+  band->prefetchThread = NULL;
+
+  /* Window sort scratch, allocated once per band instead of once per
+     row — the preview path re-runs median() on every invalidation, so
+     the old per-row g_new/g_free churned the allocator height times
+     per spinner tick. guchar is plenty: values are 0..255, and the
+     smaller footprint keeps the whole window in one cache line at r=2 */
+  band->windowScratch = g_new (guchar, SQR (band->windowRows));
+
+  // One row of selection coverage; the whole row when there is no mask
+  band->maskRow   = g_new (guchar, band->width);
+  band->spanStart = 0;
+  band->spanEnd   = band->width;
+
+  // Whole width written unless a sharded run trims it to the interior
+  band->outColStart = 0;
+  band->outWidth    = band->width;
+
+  // No warm start unless medianProcessStrip says so
+  band->warmActive   = FALSE;
+  band->warmRowStart = 0;
+  band->warmRowEnd   = 0;
+  band->warmColStart = 0;
+  band->warmColEnd   = 0;
+
+  // Horizontal-pass results of the separable mode, one per window row
+  band->hRow = g_new (guchar*, band->windowRows);
+  for (i = 0; i < band->windowRows; i++)
+    band->hRow[i] = g_new (guchar, band->width * band->channels);
+
+  /* Planar output: the engines write unit-stride runs here and the
+     dispatcher re-interleaves once per row; lane slack keeps the
+     vector stores of the last chunk inside the allocation */
+  band->outPlane = g_new (guchar*, band->channels);
+  for (i = 0; i < band->channels; i++)
+    band->outPlane[i] = g_new (guchar, band->width + MEDIAN_VEC_WIDTH);
+
+  // All channels filtered, no alpha tracking, unless median() says so
+  band->channelEnabled = (1u << band->channels) - 1;
+  band->rowChannelMask = band->channelEnabled;
+  band->alphaChannel   = -1;
+  band->alphaConstant  = FALSE;
+  band->alphaSeen      = FALSE;
+  band->alphaValue     = 0;
+
+  // Stage counters start clean whether or not instrumentation is on
+  band->statFetchUs    = 0;
+  band->statFetchBytes = 0;
+  band->statComputeUs  = 0;
+  band->statWriteUs    = 0;
+  band->statWriteBytes = 0;
+}
+
+
+// -------------------------- //
+//  Padded plane of channel k //
+//  and window row ii; column //
+//  c of the image sits at    //
+//  index c + radius          //
+// -------------------------- //
+static inline guchar *
+bandPlaneRow (MedianBandContext *band,
+              gint               k,
+              gint               windowRow)
+{
+  return band->planeRow[k * band->windowRows + windowRow];
+}
+
+
+// -------------------------- //
+//  Splits one interleaved    //
+//  input row into its padded //
+//  per-channel planes        //
+// -------------------------- //
+static inline void
+deinterleavePlaneRow (MedianBandContext *band,
+                      gint               windowRow)
+{
+  gint r = UserInputValues.radius;
+  gint k, x;
+
+  for (k = 0; k < band->channels; k++)
+    {
+      guchar       *plane = bandPlaneRow (band, k, windowRow);
+      const guchar *row   = band->inputRow[windowRow];
+
+      // The CLAMP replicates the edge pixels into the r-wide padding
+      for (x = 0; x < band->paddedWidth; x++)
+        plane[x] = row[band->channels * CLAMP (x - r, 0, band->width - 1) + k];
+    }
+}
+
+
+// -------------------------- //
+//     Compares two numbers   //
+//    used in sort algorithm  //
+// -------------------------- //
+static inline gint
+compareNumbers (const void *a, const void *b)
+{
+   const guchar *da = (const guchar *) a;
+   const guchar *db = (const guchar *) b;
+
+  return (*da > *db) - (*da < *db);
+}
+
+
+// -------------------------- //
+//    Sorts the given array   //
+//  using Heapsort algorithm  //
+// in time O(n), memory O(1)  //
+// -------------------------- //
+static inline void 
+heapSort(gint array[], gint N) 
+{
+  gint n = N, i = n/2, parent, child;
+  gint t;
+  //
+  for (;;) { 		   // Loops until array is sorted 
+    if (i > 0) { 	   // First stage - Sorting the heap 
+      i--;                 // Save its index to i 
+      t = array[i];        // Save parent value to t 
+    } else {               // Second stage - Extracting elements in-place 
+      n--;                 // Make the new heap smaller 
+      if (n == 0) return;  // When the heap is empty, we are done 
+      t = array[n];        // Save last value (it will be overwritten) 
+      array[n] = array[0]; // Save largest value at the end of array
+    }
+ 
+    parent = i;            // We will start pushing down t from parent
+    child = i*2 + 1;       // parent's left child
+ 
+    // Sift operation - pushing the value of t down the heap
+    while (child < n) {
+      if (child + 1 < n  &&  array[child + 1] > array[child]) {
+	child++;                      // Choose the largest child
+      }
+      if (array[child] > t) {         // If any child is bigger than the parent
+	array[parent] = array[child]; // Move the largest child up
+	parent = child;               // Move parent pointer to this child
+	child = parent*2 + 1;         // Find the next child
+      } else {
+	break;                        // t's place is found
+      }
+    }
+    array[parent] = t;                // We save t in the heap
+  }
+}
+
+
+// ------------------------------ //
+//   Process each tile inputRow   //
+//  dispatches to chosen engine   //
+// ------------------------------ //
+static inline void
+handleInputRow (MedianBandContext *band)
+{
+  MedianAlgorithm algorithm = ActiveAlgorithm;
+  guint           fullMask  = (1u << band->channels) - 1;
+  guint           enabled   = band->channelEnabled & fullMask;
+
+  /* While alpha has been constant over everything fetched so far, each
+     window is constant in alpha too, so copy-through is byte-exact */
+  if (band->alphaChannel >= 0 && band->alphaConstant)
+    enabled &= ~(1u << band->alphaChannel);
+
+  band->rowChannelMask = enabled;
+
+  /* The engines only fill [spanStart, spanEnd) of the enabled
+     channels; pre-seed the output with the centre row so the skipped
+     samples copy through and block writes stay whole rows */
+  if (band->spanStart > 0 || band->spanEnd < band->width ||
+      enabled != fullMask)
+    memcpy (band->outputRow,
+            band->inputRow[UserInputValues.radius],
+            band->width * band->channels);
+
+  /* The opt-in separable approximation replaces the 2-D engines
+     outright at any radius */
+  if (UserInputValues.separable)
+    {
+      handleInputRowSeparable (band);
+    }
+  else
+    {
+      /* The compile-time sorting networks beat every general engine at
+         r=1/2 and sort fully, so they return the exact same element as the
+         qsort path; route all small-radius work to them except when the
+         qsort reference is explicitly requested */
+      if (UserInputValues.radius <= 2 && algorithm != MEDIAN_ALGORITHM_QSORT)
+        algorithm = MEDIAN_ALGORITHM_SORTING_NETWORK;
+
+      switch (algorithm)
+        {
+        case MEDIAN_ALGORITHM_SORTING_NETWORK:
+          if (UserInputValues.radius <= 2)
+            {
+              handleInputRowSortingNetwork (band);
+              break;
+            }
+          // No network generated for this radius, fall through to histogram
+          /* fallthrough */
+        case MEDIAN_ALGORITHM_OPENCL: // GPU bands that fell back to row work
+          /* fallthrough */
+        case MEDIAN_ALGORITHM_HISTOGRAM:
+          handleInputRowHistogram (band);
+          break;
+
+        case MEDIAN_ALGORITHM_CONSTANT_TIME:
+          handleInputRowConstTime (band);
+          break;
+
+        case MEDIAN_ALGORITHM_QSORT:
+        default: // qsort engine stays the fallback for anything unknown
+          handleInputRowQsort (band);
+          break;
+        }
+    }
+
+  /* Re-interleave the channel planes into outputRow; skipped channels
+     and out-of-span columns keep the pre-seeded centre-row samples */
+  {
+    gint j, k;
+
+    for (k = 0; k < band->channels; k++)
+      {
+        const guchar *plane = band->outPlane[k];
+
+        if (! (enabled & (1u << k)))
+          continue;
+
+        for (j = band->spanStart; j < band->spanEnd; j++)
+          band->outputRow[band->channels * j + k] = plane[j];
+      }
+  }
+
+  /* Snapshot the raw medians and the centre row before the variant
+     pass touches them; this is what cache hits replay. Only the span
+     is copied, so a warm start never clobbers the reused columns */
+  if (band->cacheMedianRows)
+    {
+      gsize offset = (gsize) band->cacheRow * band->width * band->channels +
+                     (gsize) band->spanStart * band->channels;
+      gsize length = (gsize) (band->spanEnd - band->spanStart) *
+                     band->channels;
+      gsize inRow  = (gsize) band->spanStart * band->channels;
+
+      memcpy (band->cacheMedianRows + offset,
+              band->outputRow + inRow, length);
+      memcpy (band->cacheCenterRows + offset,
+              band->inputRow[UserInputValues.radius] + inRow, length);
+    }
+
+  /* Variant filtering, hoisted out of the engines: compare the raw
+     medians against the window-centre row in one pass */
+  if (ActiveVariantFilter)
+    ActiveVariantFilter (band->outputRow,
+                         band->inputRow[UserInputValues.radius],
+                         band->width * band->channels);
+}
+
+
+// ------------------------------ //
+//  Variant filtering as per-row  //
+//  post-filters; the right one   //
+//  is picked ONCE per median()   //
+//  call, not per pixel           //
+// ------------------------------ //
+// x < m - a
+static inline void
+variantRowBelow (guchar *medianRow, const guchar *centerRow, gint numSamples)
+{
+  gint i;
+  for (i = 0; i < numSamples; i++)
+    if (! (centerRow[i] < medianRow[i] - UserInputValues.lessThan))
+      medianRow[i] = centerRow[i];
+}
+
+// x > m + b
+static inline void
+variantRowAbove (guchar *medianRow, const guchar *centerRow, gint numSamples)
+{
+  gint i;
+  for (i = 0; i < numSamples; i++)
+    if (! (centerRow[i] > medianRow[i] + UserInputValues.greaterThan))
+      medianRow[i] = centerRow[i];
+}
+
+// m - a <= x <= m + b
+static inline void
+variantRowInside (guchar *medianRow, const guchar *centerRow, gint numSamples)
+{
+  gint i;
+  for (i = 0; i < numSamples; i++)
+    if (! (centerRow[i] >= medianRow[i] - UserInputValues.lessThan &&
+           centerRow[i] <= medianRow[i] + UserInputValues.greaterThan))
+      medianRow[i] = centerRow[i];
+}
+
+// x < m - a || x > m + b
+static inline void
+variantRowOutside (guchar *medianRow, const guchar *centerRow, gint numSamples)
+{
+  gint i;
+  for (i = 0; i < numSamples; i++)
+    if (! (centerRow[i] < medianRow[i] - UserInputValues.lessThan ||
+           centerRow[i] > medianRow[i] + UserInputValues.greaterThan))
+      medianRow[i] = centerRow[i];
+}
+
+// x >= m - a
+static inline void
+variantRowAtLeast (guchar *medianRow, const guchar *centerRow, gint numSamples)
+{
+  gint i;
+  for (i = 0; i < numSamples; i++)
+    if (! (centerRow[i] >= medianRow[i] - UserInputValues.lessThan))
+      medianRow[i] = centerRow[i];
+}
+
+// x <= m + b
+static inline void
+variantRowAtMost (guchar *medianRow, const guchar *centerRow, gint numSamples)
+{
+  gint i;
+  for (i = 0; i < numSamples; i++)
+    if (! (centerRow[i] <= medianRow[i] + UserInputValues.greaterThan))
+      medianRow[i] = centerRow[i];
+}
+
+/* Evaluates the four GUI condition flags once and selects the row
+   post-filter; replaces the six-way if chain the engines used to
+   re-evaluate for every pixel and channel */
+static inline void
+resolveFilteringVariant (void)
+{
+  if (UserInputValues.lessThan != 0 && UserInputValues.greaterThan == 0 && UserInputValues.button && !UserInputValues.button2)
+    ActiveVariantFilter = variantRowBelow;
+  else if (UserInputValues.lessThan == 0 && UserInputValues.greaterThan != 0 && !UserInputValues.button && UserInputValues.button2)
+    ActiveVariantFilter = variantRowAbove;
+  else if (UserInputValues.lessThan != 0 && UserInputValues.greaterThan != 0 && !UserInputValues.button2 && !UserInputValues.button)
+    ActiveVariantFilter = variantRowInside;
+  else if (UserInputValues.lessThan != 0 && UserInputValues.greaterThan != 0 && UserInputValues.button2 && UserInputValues.button)
+    ActiveVariantFilter = variantRowOutside;
+  else if (UserInputValues.lessThan != 0 && UserInputValues.greaterThan == 0 && !UserInputValues.button2 && !UserInputValues.button)
+    ActiveVariantFilter = variantRowAtLeast;
+  else if (UserInputValues.lessThan == 0 && UserInputValues.greaterThan != 0 && !UserInputValues.button2 && !UserInputValues.button)
+    ActiveVariantFilter = variantRowAtMost;
+  else
+    ActiveVariantFilter = NULL;  // plain median, nothing to post-filter
+}
+
+
+// ------------------------------ //
+//  Automatic engine selection:   //
+//  measured winners per radius   //
+//  bucket and channel count,     //
+//   calibrated once per host     //
+// ------------------------------ //
+static inline MedianAlgorithm
+resolveActiveAlgorithm (gint channels)
+{
+  gint b;
+
+  if (UserInputValues.algorithm != MEDIAN_ALGORITHM_AUTO)
+    return UserInputValues.algorithm;
+
+  channels = CLAMP (channels, 1, 4);
+
+  // A layout change in the table invalidates every stored winner
+  if (Calibration.version != MEDIAN_CALIB_VERSION)
+    {
+      memset (&Calibration, 0, sizeof (Calibration));
+      Calibration.version = MEDIAN_CALIB_VERSION;
+    }
+
+  if (! (Calibration.calibratedBpp & (1 << (channels - 1))))
+    {
+      medianCalibrate (channels);
+      Calibration.calibratedBpp |= 1 << (channels - 1);
+      gimp_set_data ("plug-in-median-calib", &Calibration,
+                     sizeof (Calibration));
+    }
+
+  // First bucket whose upper bound covers the requested radius
+  for (b = 0; b < MEDIAN_CALIB_NUM_RADII - 1; b++)
+    if (UserInputValues.radius <= CalibrationRadii[b])
+      break;
+
+  return (MedianAlgorithm) Calibration.winner[b][channels - 1];
+}
+
+
+/* Times the qsort, histogram and constant-time engines on a synthetic
+   noise band at every radius bucket and keeps the fastest per bucket;
+   the sorting networks need no entry since the dispatcher already owns
+   r <= 2. A fraction of a second, paid once per host and bpp */
+static inline void
+medianCalibrate (gint channels)
+{
+  static const MedianAlgorithm engines[] =
+  {
+    MEDIAN_ALGORITHM_QSORT,
+    MEDIAN_ALGORITHM_HISTOGRAM,
+    MEDIAN_ALGORITHM_CONSTANT_TIME
+  };
+  gint   savedRadius = UserInputValues.radius;
+  GRand *rand = g_rand_new_with_seed (0x6d656469);  // same noise on every host
+  gint   b, e, i, x;
+
+  for (b = 0; b < MEDIAN_CALIB_NUM_RADII; b++)
+    {
+      MedianBandContext band = { 0 };
+      gint64            best = G_MAXINT64;
+
+      UserInputValues.radius = CalibrationRadii[b];
+
+      /* An in-memory band: the engines only ever touch the window
+         buffers, so no drawable or pixel region is needed */
+      band.width     = 256;
+      band.height    = 2 * UserInputValues.radius + 1;
+      band.channels  = channels;
+      band.bandStart = 0;
+      initializeMemory (&band);
+
+      for (i = 0; i < band.windowRows; i++)
+        {
+          for (x = 0; x < band.width * channels; x++)
+            band.inputRow[i][x] = (guchar) g_rand_int_range (rand, 0, 256);
+          deinterleavePlaneRow (&band, i);
+        }
+
+      for (e = 0; e < (gint) G_N_ELEMENTS (engines); e++)
+        {
+          gint64 start, elapsed;
+          gint   reps;
+
+          if (engines[e] == MEDIAN_ALGORITHM_CONSTANT_TIME)
+            {
+              band.colHists = columnHistogramsNew (band.width, channels);
+              for (i = 0; i < band.windowRows; i++)
+                columnHistogramsAddRow (band.colHists, band.inputRow[i]);
+            }
+
+          start = g_get_monotonic_time ();
+          for (reps = 0; reps < 4; reps++)
+            {
+              switch (engines[e])
+                {
+                case MEDIAN_ALGORITHM_QSORT:
+                  handleInputRowQsort (&band);
+                  break;
+                case MEDIAN_ALGORITHM_HISTOGRAM:
+                  handleInputRowHistogram (&band);
+                  break;
+                default:
+                  handleInputRowConstTime (&band);
+                  break;
+                }
+            }
+          elapsed = g_get_monotonic_time () - start;
+
+          if (band.colHists)
+            {
+              columnHistogramsFree (band.colHists);
+              band.colHists = NULL;
+            }
+
+          if (elapsed < best)
+            {
+              best = elapsed;
+              Calibration.winner[b][channels - 1] = (gchar) engines[e];
+            }
+        }
+
+      for (i = 0; i < band.windowRows; i++)
+        {
+          g_free (band.inputRow[i]);
+          g_free (band.hRow[i]);
+        }
+      for (i = 0; i < channels * band.windowRows; i++)
+        g_free (band.planeRow[i]);
+      for (i = 0; i < channels; i++)
+        g_free (band.outPlane[i]);
+      g_free (band.planeRow);
+      g_free (band.inputRow);
+      g_free (band.hRow);
+      g_free (band.outPlane);
+      g_free (band.outputRowStore);
+      g_free (band.windowScratch);
+      g_free (band.ioBlock);
+      g_free (band.outBlock);
+      g_free (band.prefetchBlock);
+      g_free (band.maskRow);
+    }
+
+  UserInputValues.radius = savedRadius;
+  g_rand_free (rand);
+}
+
+
+// ------------------------------ //
+//   Huang sliding histogram of   //
+//  256 bins; drops left column,  //
+//  adds right one, O(r)/pixel    //
+// ------------------------------ //
+static inline void
+handleInputRowHistogram (MedianBandContext *band)
+{
+  gint k;
+  gint oneDimension = band->windowRows;
+  gint numberOfPixels = SQR(oneDimension);  //(2r+1)x(2r+1)
+
+  /* Rank of the value we report as median. The qsort engine takes
+     pixelsArray[mid+1] for our always-odd window, so to stay
+     byte-identical with it we look for the (n/2 + 2)-th smallest */
+  gint targetRank = numberOfPixels / 2 + 2;
+
+  for (k = 0; k < band->channels; k++)   // Each channel slides its own histogram
+    {
+      gint hist[256] = { 0 };
+      gint j, ii;
+      gint med = 0;       // current median candidate value
+      gint belowMed = 0;  // number of window pixels smaller than med
+
+      if (! (band->rowChannelMask & (1u << k)))
+        continue;  // disabled channel, centre row already copied through
+
+      /* Build the histogram of the leftmost selected window; the plane
+         padding already replicates the edge pixels the CLAMP used to fetch */
+      for (ii = 0; ii < oneDimension; ii++)
+        {
+          const guchar *plane = bandPlaneRow (band, k, ii) + band->spanStart;
+          gint x;
+
+          for (x = 0; x < oneDimension; x++)
+            hist[plane[x]]++;
+        }
+
+      for (j = band->spanStart; j < band->spanEnd; j++)    // For the selected span
+        {
+          // Walk med until the cumulative count reaches targetRank
+          while (belowMed + hist[med] < targetRank)
+            {
+              belowMed += hist[med];
+              med++;
+            }
+          while (belowMed >= targetRank)
+            {
+              med--;
+              belowMed -= hist[med];
+            }
+
+          // Raw median into the channel plane; re-interleaved per row
+          band->outPlane[k][j] = med;
+
+          // Slide the window one pixel right: drop left column, add right column
+          if (j + 1 < band->spanEnd)
+            {
+              for (ii = 0; ii < oneDimension; ii++)
+                {
+                  const guchar *plane = bandPlaneRow (band, k, ii);
+                  gint v = plane[j];                 // leaving column j - r
+
+                  hist[v]--;
+                  if (v < med)
+                    belowMed--;
+
+                  v = plane[j + oneDimension];       // entering column j + 1 + r
+                  hist[v]++;
+                  if (v < med)
+                    belowMed++;
+                }
+            }
+        }
+    }
+}
+
+
+// ------------------------------ //
+//  Branchless sorting networks:  //
+//  Batcher odd-even merge sort   //
+//  for the 9 and 25 element      //
+//  windows of r=1 and r=2        //
+// ------------------------------ //
+/* Comparator sequences verified exhaustively via the 0-1 principle */
+static const guchar SortingNetwork9[][2] =
+{
+  {0,1}, {2,3}, {4,5}, {6,7}, {0,2}, {1,3}, {4,6}, {5,7}, {1,2}, {5,6},
+  {0,4}, {1,5}, {2,6}, {3,7}, {2,4}, {3,5}, {1,2}, {3,4}, {5,6}, {0,8},
+  {4,8}, {2,4}, {3,5}, {6,8}, {1,2}, {3,4}, {5,6}, {7,8}
+};
+
+static const guchar SortingNetwork25[][2] =
+{
+  {0,1}, {2,3}, {4,5}, {6,7}, {8,9}, {10,11}, {12,13}, {14,15}, {16,17},
+  {18,19}, {20,21}, {22,23}, {0,2}, {1,3}, {4,6}, {5,7}, {8,10}, {9,11},
+  {12,14}, {13,15}, {16,18}, {17,19}, {20,22}, {21,23}, {1,2}, {5,6},
+  {9,10}, {13,14}, {17,18}, {21,22}, {0,4}, {1,5}, {2,6}, {3,7}, {8,12},
+  {9,13}, {10,14}, {11,15}, {16,20}, {17,21}, {18,22}, {19,23}, {2,4},
+  {3,5}, {10,12}, {11,13}, {18,20}, {19,21}, {1,2}, {3,4}, {5,6},
+  {9,10}, {11,12}, {13,14}, {17,18}, {19,20}, {21,22}, {0,8}, {1,9},
+  {2,10}, {3,11}, {4,12}, {5,13}, {6,14}, {7,15}, {16,24}, {4,8}, {5,9},
+  {6,10}, {7,11}, {20,24}, {2,4}, {3,5}, {6,8}, {7,9}, {10,12}, {11,13},
+  {18,20}, {19,21}, {22,24}, {1,2}, {3,4}, {5,6}, {7,8}, {9,10},
+  {11,12}, {13,14}, {17,18}, {19,20}, {21,22}, {23,24}, {0,16}, {1,17},
+  {2,18}, {3,19}, {4,20}, {5,21}, {6,22}, {7,23}, {8,24}, {8,16},
+  {9,17}, {10,18}, {11,19}, {12,20}, {13,21}, {14,22}, {15,23}, {4,8},
+  {5,9}, {6,10}, {7,11}, {12,16}, {13,17}, {14,18}, {15,19}, {20,24},
+  {2,4}, {3,5}, {6,8}, {7,9}, {10,12}, {11,13}, {14,16}, {15,17},
+  {18,20}, {19,21}, {22,24}, {1,2}, {3,4}, {5,6}, {7,8}, {9,10},
+  {11,12}, {13,14}, {15,16}, {17,18}, {19,20}, {21,22}, {23,24}
+};
+
+
+/* Runs one comparator sequence over a lane bundle; every step is a
+   data-independent min/max pair, so there is nothing to mispredict */
+static inline void
+sortingNetworkApply (MedianVec          *v,
+                     const guchar      (*network)[2],
+                     gint                steps)
+{
+  gint s;
+
+  for (s = 0; s < steps; s++)
+    {
+      MedianVec lo = medianVecMin (v[network[s][0]], v[network[s][1]]);
+      v[network[s][1]] = medianVecMax (v[network[s][0]], v[network[s][1]]);
+      v[network[s][0]] = lo;
+    }
+}
+
+
+/* Fully sorts each (2r+1)^2 window with the radius-specific network,
+   MEDIAN_VEC_WIDTH pixels per pass, and picks the same sorted element
+   as the qsort engine (pixelsArray[mid+1]) */
+static inline void
+handleInputRowSortingNetwork (MedianBandContext *band)
+{
+  gint r = UserInputValues.radius;    // dispatcher guarantees 1 or 2
+  gint oneDimension = band->windowRows;
+  gint numberOfPixels = SQR(oneDimension);
+  gint medianIndex = numberOfPixels / 2 + 1;
+  const guchar (*network)[2] = (r == 1) ? SortingNetwork9 : SortingNetwork25;
+  gint steps = (r == 1) ? G_N_ELEMENTS (SortingNetwork9)
+                        : G_N_ELEMENTS (SortingNetwork25);
+  gint k, ii, j;
+
+  for (k = 0; k < band->channels; k++)
+    {
+      if (! (band->rowChannelMask & (1u << k)))
+        continue;  // disabled channel, centre row already copied through
+
+      for (j = band->spanStart; j < band->spanEnd; j += MEDIAN_VEC_WIDTH)
+        {
+          MedianVec v[25];
+          gint      jj, e = 0;
+
+          /* Window element (ii,jj) of lanes j..j+15 sits at plane[j+jj];
+             the lane slack behind paddedWidth keeps the unaligned loads
+             of the last chunk inside the allocation */
+          for (ii = 0; ii < oneDimension; ii++)
+            {
+              const guchar *plane = bandPlaneRow (band, k, ii);
+
+              for (jj = 0; jj < oneDimension; jj++)
+                v[e++] = medianVecLoad (plane + j + jj);
+            }
+
+          /* A full vector store straight into the output plane; the
+             plane's lane slack absorbs the overhang of the last chunk */
+          sortingNetworkApply (v, network, steps);
+          medianVecStore (band->outPlane[k] + j, v[medianIndex]);
+        }
+    }
+}
+
+
+// ------------------------------ //
+//   Constant-time engine: per-   //
+//  column histograms maintained  //
+//   across the whole row loop    //
+// ------------------------------ //
+static inline MedianColumnHistograms *
+columnHistogramsNew (gint width,
+                     gint channels)
+{
+  MedianColumnHistograms *colHists = g_new (MedianColumnHistograms, 1);
+
+  colHists->width    = width;
+  colHists->channels = channels;
+  colHists->bins     = g_new0 (gushort, (gsize) channels * width * 256);
+  colHists->coarse   = g_new0 (gushort, (gsize) channels * width * 16);
+
+  return colHists;
+}
+
+
+static inline void
+columnHistogramsFree (MedianColumnHistograms *colHists)
+{
+  g_free (colHists->bins);
+  g_free (colHists->coarse);
+  g_free (colHists);
+}
+
+
+/* Empties every bin for the next chunk's seed */
+static inline void
+columnHistogramsReset (MedianColumnHistograms *colHists)
+{
+  memset (colHists->bins, 0,
+          (gsize) colHists->channels * colHists->width * 256 *
+          sizeof (gushort));
+  memset (colHists->coarse, 0,
+          (gsize) colHists->channels * colHists->width * 16 *
+          sizeof (gushort));
+}
+
+
+/* Counts one interleaved input row into every column histogram */
+static inline void
+columnHistogramsAddRow (MedianColumnHistograms *colHists,
+                        const guchar           *row)
+{
+  gint col, k;
+
+  for (col = 0; col < colHists->width; col++)
+    for (k = 0; k < colHists->channels; k++)
+      {
+        guchar v = row[colHists->channels * col + k];
+
+        colHists->bins[((gsize) (k * colHists->width + col) << 8) + v]++;
+        colHists->coarse[((gsize) (k * colHists->width + col) << 4)
+                         + (v >> 4)]++;
+      }
+}
+
+
+/* Removes one interleaved input row from every column histogram */
+static inline void
+columnHistogramsRemoveRow (MedianColumnHistograms *colHists,
+                           const guchar           *row)
+{
+  gint col, k;
+
+  for (col = 0; col < colHists->width; col++)
+    for (k = 0; k < colHists->channels; k++)
+      {
+        guchar v = row[colHists->channels * col + k];
+
+        colHists->bins[((gsize) (k * colHists->width + col) << 8) + v]--;
+        colHists->coarse[((gsize) (k * colHists->width + col) << 4)
+                         + (v >> 4)]--;
+      }
+}
+
+
+/* Bins of one column histogram of the given channel */
+static inline const gushort *
+colHistsColumnBins (const MedianColumnHistograms *colHists,
+                    gint                          k,
+                    gint                          col)
+{
+  return colHists->bins + (((gsize) (k * colHists->width + col)) << 8);
+}
+
+
+/* Coarse buckets of one column histogram of the given channel */
+static inline const gushort *
+colHistsColumnCoarse (const MedianColumnHistograms *colHists,
+                      gint                          k,
+                      gint                          col)
+{
+  return colHists->coarse + (((gsize) (k * colHists->width + col)) << 4);
+}
+
+
+/* Merges 2r+1 column histograms into a kernel histogram and slides
+   it along the row; per-pixel work is 2*(256+16) bin updates plus a
+   two-level median scan, no matter how big the radius is */
+static inline void
+handleInputRowConstTime (MedianBandContext *band)
+{
+  MedianColumnHistograms *colHists = band->colHists;
+  gint width    = band->width;
+  gint channels = band->channels;
+  gint k;
+  gint oneDimension = band->windowRows;
+  gint numberOfPixels = SQR(oneDimension);
+  gint targetRank = numberOfPixels / 2 + 2;  // same rank as the qsort engine
+
+  for (k = 0; k < channels; k++)
+    {
+      gint kernel[256] = { 0 };
+      gint kernelCoarse[16] = { 0 };
+      gint j, jj, b;
+
+      if (! (band->rowChannelMask & (1u << k)))
+        continue;  // disabled channel, centre row already copied through
+
+      /* Merge the 2r+1 column histograms around the first selected
+         pixel; CLAMP mirrors the qsort gather */
+      for (jj = -UserInputValues.radius; jj <= UserInputValues.radius; jj++)
+        {
+          gint col = CLAMP (band->spanStart + jj, 0, width - 1);
+          const gushort *column       = colHistsColumnBins (colHists, k, col);
+          const gushort *columnCoarse = colHistsColumnCoarse (colHists, k, col);
+
+          for (b = 0; b < 256; b++)
+            kernel[b] += column[b];
+          for (b = 0; b < 16; b++)
+            kernelCoarse[b] += columnCoarse[b];
+        }
+
+      for (j = band->spanStart; j < band->spanEnd; j++)
+        {
+          gint count = 0;
+          gint med = 0;
+          gint bucket;
+
+          /* Two-level rank scan: the coarse level skips 16 fine bins
+             per step, then the fine level finishes inside one bucket */
+          for (bucket = 0; bucket < 15; bucket++)
+            {
+              if (count + kernelCoarse[bucket] >= targetRank)
+                break;
+              count += kernelCoarse[bucket];
+            }
+          for (b = bucket << 4; b < 256; b++)
+            {
+              count += kernel[b];
+              if (count >= targetRank)
+                {
+                  med = b;
+                  break;
+                }
+            }
+
+          band->outPlane[k][j] = med;
+
+          // Slide: subtract the leaving column, add the entering one
+          if (j + 1 < band->spanEnd)
+            {
+              gint dropCol = CLAMP (j - UserInputValues.radius, 0, width - 1);
+              gint addCol  = CLAMP (j + 1 + UserInputValues.radius, 0, width - 1);
+              const gushort *dropColumn = colHistsColumnBins (colHists, k, dropCol);
+              const gushort *addColumn  = colHistsColumnBins (colHists, k, addCol);
+              const gushort *dropCoarse = colHistsColumnCoarse (colHists, k, dropCol);
+              const gushort *addCoarse  = colHistsColumnCoarse (colHists, k, addCol);
+
+              for (b = 0; b < 256; b++)
+                kernel[b] += addColumn[b] - dropColumn[b];
+              for (b = 0; b < 16; b++)
+                kernelCoarse[b] += addCoarse[b] - dropCoarse[b];
+            }
+        }
+    }
+}
+
+
+// ------------------------------ //
+//  Separable approximation: a    //
+//  horizontal 1-D median, then   //
+//  a vertical one over the       //
+//  horizontally filtered rows    //
+// ------------------------------ //
+/* Horizontal pass: Huang's sliding histogram in one dimension, 2r+1
+   taps, writing the interleaved result into hRow[windowRow]. The new
+   mode has no legacy output to reproduce, so it reports the true 1-D
+   median rather than the rank quirk the 2-D engines inherit */
+static inline void
+medianFilterRowHorizontal (MedianBandContext *band,
+                           gint               windowRow)
+{
+  gint numTaps = band->windowRows;
+  gint targetRank = numTaps / 2 + 1;
+  gint k, j;
+
+  for (k = 0; k < band->channels; k++)
+    {
+      const guchar *plane = bandPlaneRow (band, k, windowRow);
+      guchar       *out   = band->hRow[windowRow];
+      gint          hist[256] = { 0 };
+      gint          med = 0;
+      gint          belowMed = 0;
+
+      /* Statically disabled channels pass their original values along
+         so the column histograms stay well defined */
+      if (! (band->channelEnabled & (1u << k)))
+        {
+          for (j = 0; j < band->width; j++)
+            out[band->channels * j + k] = plane[j + numTaps / 2];
+          continue;
+        }
+
+      for (j = 0; j < numTaps; j++)
+        hist[plane[j]]++;
+
+      for (j = 0; j < band->width; j++)
+        {
+          while (belowMed + hist[med] < targetRank)
+            {
+              belowMed += hist[med];
+              med++;
+            }
+          while (belowMed >= targetRank)
+            {
+              med--;
+              belowMed -= hist[med];
+            }
+
+          out[band->channels * j + k] = med;
+
+          if (j + 1 < band->width)
+            {
+              gint v = plane[j];
+
+              hist[v]--;
+              if (v < med)
+                belowMed--;
+
+              v = plane[j + numTaps];
+              hist[v]++;
+              if (v < med)
+                belowMed++;
+            }
+        }
+    }
+}
+
+
+/* Vertical pass: the column histograms hold the 2r+1 horizontally
+   filtered rows of the window, so each output pixel is one two-level
+   rank scan — O(1) in the radius, against O(r^2) window membership
+   of the exact engines */
+static inline void
+handleInputRowSeparable (MedianBandContext *band)
+{
+  gint numTaps = band->windowRows;
+  gint targetRank = numTaps / 2 + 1;
+  gint k, j, b;
+
+  for (k = 0; k < band->channels; k++)
+    {
+      if (! (band->rowChannelMask & (1u << k)))
+        continue;  // disabled channel, centre row already copied through
+
+      for (j = band->spanStart; j < band->spanEnd; j++)
+        {
+          const gushort *bins   = colHistsColumnBins (band->colHists, k, j);
+          const gushort *coarse = colHistsColumnCoarse (band->colHists, k, j);
+          gint           count = 0;
+          gint           bucket;
+
+          // Coarse level first, then the fine bins of the hit bucket
+          for (bucket = 0; bucket < 15; bucket++)
+            {
+              if (count + coarse[bucket] >= targetRank)
+                break;
+              count += coarse[bucket];
+            }
+          for (b = bucket << 4; b < 256; b++)
+            {
+              count += bins[b];
+              if (count >= targetRank)
+                {
+                  band->outPlane[k][j] = b;
+                  break;
+                }
+            }
+        }
+    }
+}
+
+
+// ------------------------------ //
+//  Original per-pixel qsort path //
+// ------------------------------ //
+static inline void
+handleInputRowQsort (MedianBandContext *band)
+{
+  gint j;
+  gint oneDimension = band->windowRows;
+  gint numberOfPixels = SQR(oneDimension);  //(2r+1)x(2r+1)
+  guchar *pixelsArray = band->windowScratch;  // Per-band arena, no per-row allocation
+  gint medianResult = 0;
 
-  switch (run_mode)                                       // Handle GIMP's all run modes 
+  for (j = band->spanStart; j < band->spanEnd; j++)    // For the selected span
     {
-    case GIMP_RUN_INTERACTIVE:
-      gimp_get_data ("plug-in-median", &UserInputValues); // Get last chosen options in plug-in's GUI
-      if (! medianDialog (drawable))		          // Display the dialog window
-        return;
-      break;
+      gint k, ii, jj;
 
-    case GIMP_RUN_NONINTERACTIVE:
-      if (numberOfInputParams != 4)                           // If not enough input values
-        status = GIMP_PDB_CALLING_ERROR;                      // call error
-      if (status == GIMP_PDB_SUCCESS)                         // If you have all you need
-        UserInputValues.radius = inputValues[3].data.d_int32; // Get radius' default value
-      break;
+      /* For each layer, perform median filtering of the
+         (2r+1)x(2r+1) pixels */
+      for (k = 0; k < band->channels; k++)
+        {
+          gint index = 0; // it serves as index of local array
 
-    case GIMP_RUN_WITH_LAST_VALS:
-      gimp_get_data ("plug-in-median", &UserInputValues);     // Run with last chosen options
-      break;
+          if (! (band->rowChannelMask & (1u << k)))
+            continue;  // disabled channel, centre row already copied through
 
-    default:
-      break;
-    }
+          for (ii = 0; ii < oneDimension; ii++)  // For all tile rows in a given height
+            {
+              /* The padded plane already replicated the edges, so the
+                 window of pixel j is just plane[j] .. plane[j + 2r] */
+              const guchar *plane = bandPlaneRow (band, k, ii) + j;
 
-  median (drawable, NULL);  // Call to median function
+              for (jj = 0; jj < oneDimension; jj++)
+                {
+                  pixelsArray[index] = plane[jj];
+                  index += 1;
+                }
+            }
 
-  // These two functions send data to the gimp's core & update display
-  gimp_displays_flush ();            
-  gimp_drawable_detach (drawable);   
+          // Index of the median in the sorted array
+          gint mid = floor(numberOfPixels / 2);
 
-  //  Remember options chosen in GUI
-  if (run_mode == GIMP_RUN_INTERACTIVE)
-    gimp_set_data ("plug-in-median", &UserInputValues, sizeof (MedianInputValues));
+          // Sorts pixels and gets median value of the array
+	  //heapSort(pixelsArray, numberOfPixels); // for img 512x512px & r=10, t=30,71s
+          qsort(pixelsArray, numberOfPixels, sizeof(guchar), compareNumbers); // for img 512x512px & r=10, t=23,45s
+ 
+          // Returns median value of the given neighbour pixels
+          if ((numberOfPixels % 2) == 1 )
+            medianResult = pixelsArray[mid+1];
+          else
+            medianResult = (pixelsArray[mid] + pixelsArray[mid+1]) / 2;
 
-  return;
+          // Raw median into the channel plane; re-interleaved per row
+          band->outPlane[k][j] = medianResult;
+        }
+    }
 }
 
 
-// --------------------- //
-//    Median filtering   //
-// --------------------- //
+// -------------------------- //
+//   Shifts tile rows to put  //
+//   the new one at the end,  //
+//  keeping the planar mirror //
+//        in step too         //
+// -------------------------- //
 static inline void
-median (GimpDrawable *drawable,
-        GimpPreview  *preview)
+shuffle_tile_rows (MedianBandContext *band,
+         gint          ypos)
 {
-  gint         i, ii, channels;
-  gint         x1, y1, x2, y2;
-  GimpPixelRgn rgn_in, rgn_out;
-  guchar     **inputRow;
-  guchar      *outputRow;
-  gint         width, height;
+  gint    i, k;
+  guchar *tmp_inputRow;
 
-  // If there's no preview
-  if (! preview)
-    gimp_progress_init ("Filtr medianowy..."); // initialize progress bar at the bottom of the screen
- 
-  /* If preview is active, get upper left and lower right 
-     coordinates of the selected area of an image and
-     set preview size accordingly to width & height of selection */
-  if (preview)
-    {
-      gimp_preview_get_position (preview, &x1, &y1);   
-      gimp_preview_get_size (preview, &width, &height);
-      x2 = x1 + width;
-      y2 = y1 + height;
-    }
-  else
-    {
-      /* Find the bounding box of the current selection 
-         in relation to the specified drawable */
-      gimp_drawable_mask_bounds (drawable->drawable_id,
-                                 &x1, &y1,
-                                 &x2, &y2);
-      width = x2 - x1;
-      height = y2 - y1;
-    }
-  
-  // Get number of channels for the specified drawable (returns bytes per pixel)
-  channels = gimp_drawable_bpp (drawable->drawable_id);
+  // Get tile inputRow (i + radius + 1) into inputRow[0]
+  fetchRowBanded (band,
+                  MIN (ypos + UserInputValues.radius + 1,
+                       band->height - 1),
+                  band->inputRow[0]);
 
-  /* Allocate a big enough tile cache.
-     Multiply *2 because of also processing shadow tiles
-     Increases performance significantly */ 
-  gimp_tile_cache_ntiles (2 * (drawable->width / gimp_tile_width() + 1));
+  // Shift inputRow[i] with inputRow[i-1] and inputRow[0] with inputRow[2*radius]
+  tmp_inputRow = band->inputRow[0];
+  for (i = 1; i < band->windowRows; i++)
+    band->inputRow[i-1] = band->inputRow[i];
+  band->inputRow[band->windowRows - 1] = tmp_inputRow;
 
-  /* Initialise two pixel ranges, one to read input data,
-     and the other to write output data. */
-  gimp_pixel_rgn_init (&rgn_in,          
-                       drawable,
-                       x1, y1,
-                       width, height,
-                       FALSE, FALSE); // 2*FALSE = the range is only used to read data
-  gimp_pixel_rgn_init (&rgn_out,
-                       drawable,
-                       x1, y1,
-                       width, height,
-                       preview == NULL, TRUE); // the range is used to write data
-
-  // Allocate memory for tile inputRow and outputRow
-  initializeMemory (&inputRow, &outputRow, width * channels);
-
-  // Gets pixels into the tile input rows from (2r+1)*(2r+1) matrix. ii - controls height
-  for (ii = -UserInputValues.radius; ii <= UserInputValues.radius; ii++)
+  // Rotate each channel's planes the same way and split the fresh row
+  for (k = 0; k < band->channels; k++)
     {
-      gimp_pixel_rgn_get_row (&rgn_in,
-                              inputRow[UserInputValues.radius + ii],
-                              x1, y1 + CLAMP (ii, 0, height - 1),
-                              width);
+      guchar *tmp_plane = band->planeRow[k * band->windowRows];
+
+      for (i = 1; i < band->windowRows; i++)
+        band->planeRow[k * band->windowRows + i - 1] =
+          band->planeRow[k * band->windowRows + i];
+      band->planeRow[k * band->windowRows + band->windowRows - 1] = tmp_plane;
     }
+  deinterleavePlaneRow (band, band->windowRows - 1);
 
-  // To be done for all tile input rows
-  for (i = 0; i < height; i++)
+  // Separable mode rotates its horizontal-pass rows in step and
+  // filters the fresh bottom row before it joins the column histograms
+  if (UserInputValues.separable)
     {
-      // Perform the actual median filtering
-      handleInputRow  (inputRow,
-                       outputRow,
-                       width,
-                       channels);
-      // Set pixels into to the outputRow
-      gimp_pixel_rgn_set_row (&rgn_out,
-                              outputRow,
-                              x1, i + y1,
-                              width);
-      // Shift tile rows to insert the new one at the end
-      shuffle_tile_rows (&rgn_in,
-              		 inputRow,
-               		 x1, y1,
-              		 width, height,
-               		 i);
+      guchar *tmp_hRow = band->hRow[0];
 
-      // Update progress bar in GIMP's GUI
-      if (! preview && i % 16 == 0)
-        gimp_progress_update ((gdouble) i / (gdouble) height);
-    }
-
-  // Free the memory
-  g_free (inputRow);
-  g_free (outputRow);
+      for (i = 1; i < band->windowRows; i++)
+        band->hRow[i-1] = band->hRow[i];
+      band->hRow[band->windowRows - 1] = tmp_hRow;
 
-  // Update the modified region on preview
-  if (preview)
-    {
-      gimp_drawable_preview_draw_region (GIMP_DRAWABLE_PREVIEW (preview),
-                                         &rgn_out);
-    }
-  else
-    {
-      gimp_drawable_flush (drawable);                           // send tile data to the core and get results 
-      gimp_drawable_merge_shadow (drawable->drawable_id, TRUE); // merge shadow buffer with drawable
-      gimp_drawable_update (drawable->drawable_id,              // update the processed region of drawable
-                            x1, y1,
-                            width, height);
+      medianFilterRowHorizontal (band, band->windowRows - 1);
     }
 }
 
 
 // -------------------------- //
-// Allocates memory for input //
-//       and output rows      //
+//  Filters every layer of an //
+//  image in one invocation,  //
+//  sharing startup cost and  //
+//     one progress bar       //
 // -------------------------- //
 static inline void
-initializeMemory (guchar ***inputRow,
-          guchar  **outputRow,
-          gint      num_bytes)
+medianProcessAllLayers (gint32 image)
 {
-  gint i;
+  gint  numLayers = 0;
+  gint  l;
+  gint *layers = gimp_image_get_layers (image, &numLayers);
 
-  // Allocate memory for one input row
-  *inputRow = g_new (guchar*, (2 * UserInputValues.radius + 1));
+  ProgressLayerCount = MAX (numLayers, 1);
 
-  // Now go from bottom to top and allocate enough memory for all input rows in input matrix
-  for (i = -UserInputValues.radius; i <= UserInputValues.radius; i++)
-  {
-    (*inputRow)[i + UserInputValues.radius] = g_new (guchar, num_bytes);
-  }
-  // Allocate memory for output row (need only enough for one)
-  *outputRow = g_new (guchar, num_bytes);  
+  for (l = 0; l < numLayers; l++)
+    {
+      GimpDrawable *drawable = gimp_drawable_get (layers[l]);
+
+      ProgressLayerIndex = l;
+      median (drawable, NULL);
+      gimp_drawable_detach (drawable);
+    }
+
+  ProgressLayerIndex = 0;
+  ProgressLayerCount = 1;
+  g_free (layers);
 }
 
 
 // -------------------------- //
-//     Compares two numbers   //
-//    used in sort algorithm  //
+//  Headless benchmark: noise //
+//  image, radius sweep, one  //
+//  g_message per config      //
 // -------------------------- //
-static inline gint 
-compareNumbers (const void *a, const void *b)
+static inline void
+medianBench (gint size,
+             gint maxRadius)
 {
-   const gint *da = (const gint *) a;
-   const gint *db = (const gint *) b;
+  /* Engines to sweep; MEDIAN_ALGORITHM_SORTING_NETWORK is exercised
+     implicitly by the small radii of every non-qsort engine */
+  static const struct
+  {
+    MedianAlgorithm algorithm;
+    const gchar    *name;
+  } engines[] =
+  {
+    { MEDIAN_ALGORITHM_QSORT,         "qsort"         },
+    { MEDIAN_ALGORITHM_HISTOGRAM,     "histogram"     },
+    { MEDIAN_ALGORITHM_CONSTANT_TIME, "constant-time" }
+  };
 
-  return (*da > *db) - (*da < *db);
+  MedianInputValues savedValues = UserInputValues;
+  gint32        image, layer;
+  GimpDrawable *drawable;
+  GimpPixelRgn  rgn;
+  guchar       *noise;
+  GRand        *rand;
+  gsize         numBytes;
+  gsize         i;
+  guint         e;
+  gint          radius;
+
+  size      = CLAMP (size, 64, 16384);
+  maxRadius = CLAMP (maxRadius, 1, 30);
+
+  // Build the synthetic noise drawable the whole sweep reuses
+  image = gimp_image_new (size, size, GIMP_RGB);
+  layer = gimp_layer_new (image, "noise", size, size,
+                          GIMP_RGB_IMAGE, 100.0, GIMP_NORMAL_MODE);
+  gimp_image_insert_layer (image, layer, -1, 0);
+
+  drawable = gimp_drawable_get (layer);
+  numBytes = (gsize) size * size * 3;
+  noise    = g_new (guchar, numBytes);
+  rand     = g_rand_new_with_seed (0x6d656469);  // fixed seed, runs comparable
+
+  for (i = 0; i < numBytes; i++)
+    noise[i] = (guchar) g_rand_int_range (rand, 0, 256);
+
+  gimp_pixel_rgn_init (&rgn, drawable, 0, 0, size, size, TRUE, FALSE);
+  gimp_pixel_rgn_set_rect (&rgn, noise, 0, 0, size, size);
+  gimp_drawable_flush (drawable);
+  g_free (noise);
+  g_rand_free (rand);
+
+  // Plain exact median, no variant post-filter
+  UserInputValues.lessThan    = 0;
+  UserInputValues.greaterThan = 0;
+  UserInputValues.button      = FALSE;
+  UserInputValues.button2     = FALSE;
+  UserInputValues.separable   = FALSE;
+
+  for (e = 0; e < G_N_ELEMENTS (engines); e++)
+    {
+      UserInputValues.algorithm = engines[e].algorithm;
+
+      for (radius = 1; radius <= maxRadius; radius++)
+        {
+          struct rusage usage;
+          gint64        start, elapsed;
+
+          UserInputValues.radius = radius;
+
+          start = g_get_monotonic_time ();
+          median (drawable, NULL);
+          elapsed = g_get_monotonic_time () - start;
+
+          getrusage (RUSAGE_SELF, &usage);
+
+          g_message ("median-bench: engine=%s radius=%d size=%dx%d "
+                     "wall=%.3fs rows/sec=%.0f peak-rss=%ldkB",
+                     engines[e].name, radius, size, size,
+                     (gdouble) elapsed / 1e6,
+                     (gdouble) size / ((gdouble) elapsed / 1e6),
+                     usage.ru_maxrss);
+        }
+    }
+
+  gimp_image_delete (image);
+  gimp_drawable_detach (drawable);
+
+  UserInputValues = savedValues;
 }
 
 
 // -------------------------- //
-//    Sorts the given array   //
-//  using Heapsort algorithm  //
-// in time O(n), memory O(1)  //
+//  Headless regression suite //
+//  over engines, fixtures    //
+//       and all radii        //
 // -------------------------- //
-static inline void 
-heapSort(gint array[], gint N) 
+/* Filters one fixture drawable with the current UserInputValues and
+   reads the merged result back; the input is rewritten first so every
+   engine sees the same pixels */
+static inline void
+medianVerifyRun (GimpDrawable *drawable,
+                 const guchar *input,
+                 guchar       *output,
+                 gint          size,
+                 gint64       *wallUs)
 {
-  gint n = N, i = n/2, parent, child;
-  gint t;
-  //
-  for (;;) { 		   // Loops until array is sorted 
-    if (i > 0) { 	   // First stage - Sorting the heap 
-      i--;                 // Save its index to i 
-      t = array[i];        // Save parent value to t 
-    } else {               // Second stage - Extracting elements in-place 
-      n--;                 // Make the new heap smaller 
-      if (n == 0) return;  // When the heap is empty, we are done 
-      t = array[n];        // Save last value (it will be overwritten) 
-      array[n] = array[0]; // Save largest value at the end of array
-    }
- 
-    parent = i;            // We will start pushing down t from parent
-    child = i*2 + 1;       // parent's left child
- 
-    // Sift operation - pushing the value of t down the heap
-    while (child < n) {
-      if (child + 1 < n  &&  array[child + 1] > array[child]) {
-	child++;                      // Choose the largest child
-      }
-      if (array[child] > t) {         // If any child is bigger than the parent
-	array[parent] = array[child]; // Move the largest child up
-	parent = child;               // Move parent pointer to this child
-	child = parent*2 + 1;         // Find the next child
-      } else {
-	break;                        // t's place is found
-      }
-    }
-    array[parent] = t;                // We save t in the heap
-  }
+  GimpPixelRgn rgn;
+  gint64       start;
+
+  gimp_pixel_rgn_init (&rgn, drawable, 0, 0, size, size, TRUE, FALSE);
+  gimp_pixel_rgn_set_rect (&rgn, input, 0, 0, size, size);
+  gimp_drawable_flush (drawable);
+
+  start = g_get_monotonic_time ();
+  median (drawable, NULL);
+  *wallUs = g_get_monotonic_time () - start;
+
+  gimp_pixel_rgn_init (&rgn, drawable, 0, 0, size, size, FALSE, FALSE);
+  gimp_pixel_rgn_get_rect (&rgn, output, 0, 0, size, size);
 }
 
 
-// ------------------------------ //
-//   Process each tile inputRow   //
-// ------------------------------ //
 static inline void
-handleInputRow (guchar **inputRow,
-             guchar  *outputRow,
-             gint     width,
-             gint     channels)
+medianVerify (gint size,
+              gint maxRadius)
 {
-  gint j;
-  gint oneDimension = 2 * UserInputValues.radius + 1;
-  gint numberOfPixels = SQR(oneDimension);  //(2r+1)x(2r+1)
-  gint *pixelsArray = g_new (gint, numberOfPixels);  // Allocate enough memory for local array of pixels
-  gint result = 0;
-  gint medianResult = 0;
+  /* Exact engines checked byte-for-byte against the qsort reference;
+     the sorting-network engine is reached through the small radii of
+     each of them, and OpenCL only runs when a device is usable */
+  static const struct
+  {
+    MedianAlgorithm algorithm;
+    const gchar    *name;
+  } engines[] =
+  {
+    { MEDIAN_ALGORITHM_HISTOGRAM,     "histogram"     },
+    { MEDIAN_ALGORITHM_CONSTANT_TIME, "constant-time" },
+#ifdef HAVE_OPENCL
+    { MEDIAN_ALGORITHM_OPENCL,        "opencl"        },
+#endif
+  };
+
+  static const struct
+  {
+    GimpImageBaseType base;
+    GimpImageType     type;
+    gint              channels;
+    const gchar      *name;
+  } fixtures[] =
+  {
+    { GIMP_GRAY, GIMP_GRAY_IMAGE, 1, "GRAY" },
+    { GIMP_RGB,  GIMP_RGB_IMAGE,  3, "RGB"  },
+    { GIMP_RGB,  GIMP_RGBA_IMAGE, 4, "RGBA" },
+  };
+
+  /* Nine distinct values whose 6th smallest is 60: the reference rank
+     is (n/2 + 2)-th smallest, the pixelsArray[mid + 1] definition the
+     original qsort engine shipped with. A new engine that drifts to
+     the textbook n/2 + 1 rank fails this before any noise test runs */
+  static const guchar rankPixels[9] =
+    { 90, 10, 50, 30, 70, 20, 80, 40, 60 };
 
-  for (j = 0; j < width; j++)    // For the whole inputRow
+  MedianInputValues savedValues = UserInputValues;
+  GimpDrawable *drawable;
+  gint32        image, layer;
+  guchar        rankOut[9];
+  GRand        *rand;
+  guint         f, e;
+  gint          radius;
+  gint64        wallUs;
+
+  size      = CLAMP (size, 64, 4096);
+  maxRadius = CLAMP (maxRadius, 1, 30);
+
+  // Plain exact median, no variant post-filter, all channels
+  UserInputValues.lessThan    = 0;
+  UserInputValues.greaterThan = 0;
+  UserInputValues.button      = FALSE;
+  UserInputValues.button2     = FALSE;
+  UserInputValues.separable   = FALSE;
+  UserInputValues.channel[0]  = TRUE;
+  UserInputValues.channel[1]  = TRUE;
+  UserInputValues.channel[2]  = TRUE;
+  UserInputValues.channel[3]  = TRUE;
+
+  // Rank-definition pin: one 3x3 window, r=1, qsort engine
+  image = gimp_image_new (3, 3, GIMP_GRAY);
+  layer = gimp_layer_new (image, "rank", 3, 3,
+                          GIMP_GRAY_IMAGE, 100.0, GIMP_NORMAL_MODE);
+  gimp_image_insert_layer (image, layer, -1, 0);
+  drawable = gimp_drawable_get (layer);
+
+  UserInputValues.algorithm = MEDIAN_ALGORITHM_QSORT;
+  UserInputValues.radius    = 1;
+  medianVerifyRun (drawable, rankPixels, rankOut, 3, &wallUs);
+
+  g_message ("median-verify: check=rank-definition expected=60 got=%d "
+             "status=%s", rankOut[4],
+             rankOut[4] == 60 ? "ok" : "MISMATCH");
+
+  gimp_image_delete (image);
+  gimp_drawable_detach (drawable);
+
+  rand = g_rand_new_with_seed (0x6d656469);  // fixed seed, runs comparable
+
+  for (f = 0; f < G_N_ELEMENTS (fixtures); f++)
     {
-      gint k, ii, jj;
-      gint left = (j - UserInputValues.radius),
-           right = (j + UserInputValues.radius);    
-      	 
-      /* For each layer, perform median filtering of the
-         (2r+1)x(2r+1) pixels */
-      for (k = 0; k < channels; k++)
-        {           	  
-          gint index = 0; // it serves as index of local array
-         
-          for (ii = 0; ii < 2 * UserInputValues.radius + 1; ii++)  // For all tile rows in a given height
-            for (jj = left; jj <= right; jj++)                     // process each tile inputRow in a given width
-            { 
-	      // Assigns pixel value; CLAMP prevents going over image edges   
-              pixelsArray[index] = inputRow[ii][channels * CLAMP (jj, 0, width - 1) + k]; 
-              index += 1;
-            }
+      gsize   numBytes = (gsize) size * size * fixtures[f].channels;
+      guchar *input    = g_new (guchar, numBytes);
+      guchar *ref      = g_new (guchar, numBytes);
+      guchar *out      = g_new (guchar, numBytes);
+      gsize   i;
 
-          // Gets the currently worked on pixel
-          gint mid = floor(numberOfPixels / 2); 
-          gint middlePixel = pixelsArray[mid];
+      // Uniform noise with 5% full-pixel impulses, the worst case for
+      // a median filter and the easiest to spot when an engine drifts
+      for (i = 0; i < numBytes; i++)
+        input[i] = (guchar) g_rand_int_range (rand, 0, 256);
+      for (i = 0; i < (gsize) size * size / 20; i++)
+        {
+          gsize  pixel = (gsize) g_rand_int_range (rand, 0, size * size);
+          guchar value = g_rand_boolean (rand) ? 255 : 0;
+          gint   k;
 
-          // Sorts pixels and gets median value of the array
-	  //heapSort(pixelsArray, numberOfPixels); // for img 512x512px & r=10, t=30,71s
-          qsort(pixelsArray, numberOfPixels, sizeof(gint), compareNumbers); // for img 512x512px & r=10, t=23,45s
- 
-          // Returns median value of the given neighbour pixels
-          if ((numberOfPixels % 2) == 1 )
-            medianResult = pixelsArray[mid+1];
-          else
-            medianResult = (pixelsArray[mid] + pixelsArray[mid+1]) / 2;
+          for (k = 0; k < fixtures[f].channels; k++)
+            input[pixel * fixtures[f].channels + k] = value;
+        }
+
+      image = gimp_image_new (size, size, fixtures[f].base);
+      layer = gimp_layer_new (image, "fixture", size, size,
+                              fixtures[f].type, 100.0, GIMP_NORMAL_MODE);
+      gimp_image_insert_layer (image, layer, -1, 0);
+      drawable = gimp_drawable_get (layer);
+
+      for (radius = 1; radius <= maxRadius; radius++)
+        {
+          UserInputValues.radius = radius;
+
+          // qsort is the reference everything else is held against
+          UserInputValues.algorithm = MEDIAN_ALGORITHM_QSORT;
+          medianVerifyRun (drawable, input, ref, size, &wallUs);
+          g_message ("median-verify: type=%s engine=qsort radius=%d "
+                     "status=reference wall=%.3fs",
+                     fixtures[f].name, radius, (gdouble) wallUs / 1e6);
+
+          for (e = 0; e < G_N_ELEMENTS (engines); e++)
+            {
+              gsize diffs = 0;
+              gsize firstDiff = 0;
+
+#ifdef HAVE_OPENCL
+              if (engines[e].algorithm == MEDIAN_ALGORITHM_OPENCL &&
+                  ! medianOpenClAvailable ())
+                {
+                  g_message ("median-verify: type=%s engine=%s radius=%d "
+                             "status=skipped", fixtures[f].name,
+                             engines[e].name, radius);
+                  continue;
+                }
+#endif
+
+              UserInputValues.algorithm = engines[e].algorithm;
+              medianVerifyRun (drawable, input, out, size, &wallUs);
+
+              for (i = 0; i < numBytes; i++)
+                if (out[i] != ref[i])
+                  {
+                    if (diffs == 0)
+                      firstDiff = i;
+                    diffs++;
+                  }
+
+              g_message ("median-verify: type=%s engine=%s radius=%d "
+                         "status=%s diffs=%" G_GSIZE_FORMAT
+                         " first-offset=%" G_GSIZE_FORMAT " wall=%.3fs",
+                         fixtures[f].name, engines[e].name, radius,
+                         diffs == 0 ? "ok" : "MISMATCH",
+                         diffs, firstDiff, (gdouble) wallUs / 1e6);
+            }
+
+          /* Approximate mode: no byte identity to demand, so report
+             the error bound against the exact reference instead */
+          UserInputValues.algorithm = MEDIAN_ALGORITHM_HISTOGRAM;
+          UserInputValues.separable = TRUE;
+          medianVerifyRun (drawable, input, out, size, &wallUs);
+          UserInputValues.separable = FALSE;
 
-          // Check variants of filtering
-	  if (UserInputValues.lessThan != 0 && UserInputValues.greaterThan == 0 && UserInputValues.button && !UserInputValues.button2)
-	  { // x < m - a
-             if (middlePixel < (medianResult - UserInputValues.lessThan))
-             	result = medianResult;
-             else
-                result = middlePixel;
-          }
-          else if (UserInputValues.lessThan == 0 && UserInputValues.greaterThan != 0 && !UserInputValues.button && UserInputValues.button2)
-          { // x > m + b
-             if (middlePixel > (medianResult + UserInputValues.greaterThan))
-             	result = medianResult;
-             else
-                result = middlePixel;
-          } // m - a <= x <= m + b
-	  else if (UserInputValues.lessThan != 0 && UserInputValues.greaterThan != 0 && !UserInputValues.button2 && !UserInputValues.button)
-          {
-             if (middlePixel >= (medianResult - UserInputValues.lessThan) && middlePixel <= (medianResult + UserInputValues.greaterThan))
-             	result = medianResult;
-             else
-                result = middlePixel;
-          } // x < m - a || x > m + b
-          else if (UserInputValues.lessThan != 0 && UserInputValues.greaterThan != 0 && UserInputValues.button2 && UserInputValues.button)
-          {
-             if (middlePixel < (medianResult - UserInputValues.lessThan) || middlePixel > (medianResult + UserInputValues.greaterThan))
-             	result = medianResult;
-             else
-                result = middlePixel;
-          } // x >= m - a
-	  else if (UserInputValues.lessThan != 0 && UserInputValues.greaterThan == 0 && !UserInputValues.button2 && !UserInputValues.button)
           {
-             if (middlePixel >= (medianResult - UserInputValues.lessThan))
-             	result = medianResult;
-             else
-                result = middlePixel;
-	  }
-	  else if (UserInputValues.lessThan == 0 && UserInputValues.greaterThan != 0 && !UserInputValues.button2 && !UserInputValues.button)
-          { // x <= m + b
-             if (middlePixel <= (medianResult + UserInputValues.greaterThan))
-             	result = medianResult;
-             else
-                result = middlePixel;
-          } 
-          else
-	     result = medianResult;
+            gint maxDiff = 0;
+
+            for (i = 0; i < numBytes; i++)
+              maxDiff = MAX (maxDiff, ABS ((gint) out[i] - (gint) ref[i]));
 
-          // Return result of median filtering
-          outputRow[channels * j + k] = result;  
+            g_message ("median-verify: type=%s engine=separable radius=%d "
+                       "status=approx max-error=%d wall=%.3fs",
+                       fixtures[f].name, radius, maxDiff,
+                       (gdouble) wallUs / 1e6);
+          }
         }
+
+      gimp_image_delete (image);
+      gimp_drawable_detach (drawable);
+      g_free (input);
+      g_free (ref);
+      g_free (out);
     }
-  g_free(pixelsArray); // Free memomy of local array
+
+  g_rand_free (rand);
+  UserInputValues = savedValues;
 }
 
 
 // -------------------------- //
-//   Shifts tile rows to put  //
-//   the new one at the end   //
+//   Invalidation coalescing  //
+//   for the preview widget   //
 // -------------------------- //
-static inline void
-shuffle_tile_rows (GimpPixelRgn *rgn_in,
-         guchar      **inputRow,
-         gint          x1,
-         gint          y1,
-         gint          width,
-         gint          height,
-         gint          ypos)
+/* Timeout body: the burst is over, run the one real invalidation */
+static inline gboolean
+medianPreviewInvalidateNow (gpointer data)
 {
-  gint    i;
-  guchar *tmp_inputRow;
+  PreviewDebounceId = 0;
+  gimp_preview_invalidate (GIMP_PREVIEW (data));
 
-  // Get tile inputRow (i + radius + 1) into inputRow[0]
-  gimp_pixel_rgn_get_row (rgn_in,
-                          inputRow[0],
-                          x1, MIN (ypos + UserInputValues.radius + y1, y1 + height - 1),
-                          width);
+  return FALSE;  // one-shot
+}
 
-  // Shift inputRow[i] with inputRow[i-1] and inputRow[0] with inputRow[2*radius] 
-  tmp_inputRow = inputRow[0];
-  for (i = 1; i < 2 * UserInputValues.radius + 1; i++)
-    inputRow[i-1] = inputRow[i];
-  inputRow[2 * UserInputValues.radius] = tmp_inputRow;
+
+/* Wired to every parameter widget instead of gimp_preview_invalidate:
+   (re)arms the debounce timeout so back-to-back changes collapse into
+   a single recompute, and flags any in-flight pass as stale */
+static inline void
+medianPreviewInvalidateDebounced (GtkWidget *widget)
+{
+  if (PreviewRunInFlight)
+    g_atomic_int_set (&MedianCancelRequested, 1);
+
+  if (PreviewDebounceId)
+    g_source_remove (PreviewDebounceId);
+  PreviewDebounceId = g_timeout_add (MEDIAN_PREVIEW_DEBOUNCE_MS,
+                                     medianPreviewInvalidateNow, widget);
 }
 
 
@@ -565,6 +4034,13 @@ medianDialog (GimpDrawable *drawable)
   GtkWidget *hints;
   GtkWidget *button;
   GtkWidget *button2;
+  GtkWidget *button3;
+  GtkWidget *frame3;
+  GtkWidget *frame_label3;
+  GtkWidget *alignment3;
+  GtkWidget *third_hbox;
+  GtkWidget *channelButton[4];
+  gint       k;
   gboolean   run;
 
   gimp_ui_init ("median", FALSE);  // initialise GTK+, does all the magic so the 
@@ -683,33 +4159,86 @@ medianDialog (GimpDrawable *drawable)
   gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (button2), UserInputValues.button2);
   gtk_widget_show (button2);
 
+  // Checkbox for the approximate separable mode (fast at large radii)
+  button3 = gtk_check_button_new_with_label ("Separowalny (przybliżony)");
+  gtk_box_pack_start (GTK_BOX (second_hbox), button3, FALSE, FALSE, 3);
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (button3), UserInputValues.separable);
+  gtk_widget_show (button3);
+
   // Add label to the previously created frame2
   frame_label2 = gtk_label_new ("<b>Filtrowanie wariantowe</b>");
   gtk_widget_show (frame_label2);
   gtk_frame_set_label_widget (GTK_FRAME (frame2), frame_label2);
   gtk_label_set_use_markup (GTK_LABEL (frame_label2), TRUE);
 
+  // Create frame with the per-channel enable checkboxes
+  frame3 = gtk_frame_new (NULL);
+  gtk_widget_show (frame3);
+  gtk_box_pack_start (GTK_BOX (main_vbox), frame3, TRUE, TRUE, 0);
+  gtk_container_set_border_width (GTK_CONTAINER (frame3), 6);
+
+  // Set padding
+  alignment3 = gtk_alignment_new (0.5, 0.5, 1, 1);
+  gtk_widget_show (alignment3);
+  gtk_container_add (GTK_CONTAINER (frame3), alignment3);
+  gtk_alignment_set_padding (GTK_ALIGNMENT (alignment3), 6, 6, 6, 6);
+
+  // Create new horizontal box to hold the channel checkboxes
+  third_hbox = gtk_hbox_new (FALSE, 0);
+  gtk_widget_show (third_hbox);
+  gtk_container_add (GTK_CONTAINER (alignment3), third_hbox);
+
+  /* One enable checkbox per potential channel; unchecked channels copy
+     their input through instead of being median-filtered */
+  for (k = 0; k < 4; k++)
+    {
+      static const gchar *channelNames[4] = { "R", "G", "B", "A" };
+
+      channelButton[k] = gtk_check_button_new_with_label (channelNames[k]);
+      gtk_box_pack_start (GTK_BOX (third_hbox), channelButton[k],
+                          FALSE, FALSE, 3);
+      gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (channelButton[k]),
+                                    UserInputValues.channel[k]);
+      gtk_widget_show (channelButton[k]);
+
+      g_signal_connect (channelButton[k], "clicked",
+                        G_CALLBACK (gimp_toggle_button_update),
+                        &UserInputValues.channel[k]);
+      g_signal_connect_swapped (channelButton[k], "clicked",
+                                G_CALLBACK (medianPreviewInvalidateDebounced),
+                                preview);
+    }
+
+  // Add label to the previously created frame3
+  frame_label3 = gtk_label_new ("<b>Kanały</b>");
+  gtk_widget_show (frame_label3);
+  gtk_frame_set_label_widget (GTK_FRAME (frame3), frame_label3);
+  gtk_label_set_use_markup (GTK_LABEL (frame_label3), TRUE);
+
   // Adjust dialog accordingly to user input
   g_signal_connect_swapped (preview, "invalidated",
                             G_CALLBACK (median),
                             drawable);
   g_signal_connect_swapped (spinbutton_adj, "value_changed",
-                            G_CALLBACK (gimp_preview_invalidate),
+                            G_CALLBACK (medianPreviewInvalidateDebounced),
                             preview);
   g_signal_connect_swapped (spinbutton_adj, "value_changed",
                             G_CALLBACK (gtk_widget_show),
                             hints);
   g_signal_connect_swapped (spinbutton_adj2, "value_changed",
-                            G_CALLBACK (gimp_preview_invalidate),
+                            G_CALLBACK (medianPreviewInvalidateDebounced),
                             preview);
   g_signal_connect_swapped (spinbutton_adj3, "value_changed",
-                            G_CALLBACK (gimp_preview_invalidate),
+                            G_CALLBACK (medianPreviewInvalidateDebounced),
                             preview);
   g_signal_connect_swapped (button, "clicked",
-                            G_CALLBACK (gimp_preview_invalidate),
+                            G_CALLBACK (medianPreviewInvalidateDebounced),
                             preview);
   g_signal_connect_swapped (button2, "clicked",
-                            G_CALLBACK (gimp_preview_invalidate),
+                            G_CALLBACK (medianPreviewInvalidateDebounced),
+                            preview);
+  g_signal_connect_swapped (button3, "clicked",
+                            G_CALLBACK (medianPreviewInvalidateDebounced),
                             preview);
   gtk_widget_show (dialog);
  
@@ -726,6 +4255,9 @@ medianDialog (GimpDrawable *drawable)
   g_signal_connect (button2, "clicked",
                     G_CALLBACK (gimp_toggle_button_update),
                     &UserInputValues.button2);
+  g_signal_connect (button3, "clicked",
+                    G_CALLBACK (gimp_toggle_button_update),
+                    &UserInputValues.separable);
   g_signal_connect (spinbutton_adj2, "value_changed",
                     G_CALLBACK (gimp_int_adjustment_update),
                     &UserInputValues.lessThan);